@@ -25,6 +25,7 @@
 #include "kmacros.h"
 #include "rfmix.h"
 #include "mm.h"
+#include "thread-pool.h"
 
 extern rfmix_opts_t rfmix_opts;
 extern int em_iteration;
@@ -75,15 +76,30 @@ static void compute_state_change(double *r_stay, double *r_change, double d, int
   *r_change = r;
 }
 
+/* Finds the next segment of consecutive windows, from window start on, where the
+   haplotype is analyzed. Those are all of them but with --hierarchy, where a group's
+   query haplotypes are only analyzed in the windows assigned to it and have a viterbi
+   path of -1 in the others (see restrict_hierarchy_level()). Returns the first window
+   of the segment, or n_windows if there is none, and sets *end past its last. */
+static int next_segment(int8_t *msp, int start, int n_windows, int *end) {
+  while(start < n_windows && msp[start] == -1) start++;
+  *end = start;
+  while(*end < n_windows && msp[*end] != -1) (*end)++;
+  return start;
+}
+
 static double viterbi(sample_t *sample, int haplotype, crf_window_t *crf_windows,
 		      int n_windows, int n_subpops, snp_t *snps, double w, mm *ma) {
   int i, j, k;
+  int start, end;
+  int8_t *msp = sample->msp[haplotype];
 
   /* Decode the estimated probabilities from random forest and cache in an array
      as doubles. If we do not use the IDX macro to do the indexing, we will typically
      use as much or more memory setting up the pointers as we will storing data */
   double *p = (double *) ma->allocate(sizeof(double)*n_windows*n_subpops, WHEREFROM);
   for(i=0; i < n_windows; i++) {
+    if (msp[i] == -1) continue;
     for(k=0; k < n_subpops; k++) {
       double tmp = DF16(sample->est_p[haplotype][ IDX(i,k) ]);
       if (tmp <= 0.) tmp = 0.000001;
@@ -99,7 +115,7 @@ static double viterbi(sample_t *sample, int haplotype, crf_window_t *crf_windows
     for(k=0; k < n_subpops; k++)
       initial_p[k] = 1.;
     for(i=0; i < n_windows; i++)
-      initial_p[sample->msp[haplotype][i]]++;
+      if (msp[i] != -1) initial_p[msp[i]]++;
     normalize_vector(initial_p, n_subpops);
     for(k=0; k < n_subpops; k++)
       initial_p[k] = log(initial_p[k]);
@@ -112,167 +128,184 @@ static double viterbi(sample_t *sample, int haplotype, crf_window_t *crf_windows
   int *phi = (int *) ma->allocate(sizeof(int)*n_subpops*n_windows, WHEREFROM);
   double *d = (double *) ma->allocate(sizeof(double)*n_subpops, WHEREFROM);
   double *nd = (double *) ma->allocate(sizeof(double)*n_subpops, WHEREFROM);
+  int8_t *path = (int8_t *) ma->allocate(sizeof(int8_t)*n_windows, WHEREFROM);
   double *swap_d;
   double max_d;
   int max_state;
-  
-  for(k=0; k < n_subpops; k++)
-    d[k] = initial_p[k] + p[ IDX(0,k) ];
+  double logl = 0.;
+
+  /* Each segment of analyzed windows is decoded on its own, and the log likelihood
+     is the sum of theirs */
+  for(start=next_segment(msp, 0, n_windows, &end); start < n_windows;
+      start=next_segment(msp, end, n_windows, &end)) {
+    for(k=0; k < n_subpops; k++)
+      d[k] = initial_p[k] + p[ IDX(start,k) ];
 
-  for(i=1; i < n_windows; i++) {
-    double stay, change;
+    for(i=start+1; i < end; i++) {
+      double stay, change;
     
-    compute_state_change(&stay, &change,
-			 crf_windows[i].genetic_pos - crf_windows[i-1].genetic_pos,
-			 rfmix_opts.n_generations,w);
-    double log_stay = (double) log(stay);
-    double log_change = (double) log(change);
+      compute_state_change(&stay, &change,
+			   crf_windows[i].genetic_pos - crf_windows[i-1].genetic_pos,
+			   rfmix_opts.n_generations,w);
+      double log_stay = (double) log(stay);
+      double log_change = (double) log(change);
     
-    for(j=0; j < n_subpops; j++) {
-      double p_obs = p[ IDX(i,j) ];
-
-      max_state = -1; max_d = -DBL_MAX;
-      for(k=0; k < n_subpops; k++) {
-	double tmp_d = d[k] + p_obs + ( (j==k) ? log_stay : log_change );
-	if (tmp_d > max_d) {
-	  max_state = k;
-	  max_d = tmp_d;
+      for(j=0; j < n_subpops; j++) {
+	double p_obs = p[ IDX(i,j) ];
+
+	max_state = -1; max_d = -DBL_MAX;
+	for(k=0; k < n_subpops; k++) {
+	  double tmp_d = d[k] + p_obs + ( (j==k) ? log_stay : log_change );
+	  if (tmp_d > max_d) {
+	    max_state = k;
+	    max_d = tmp_d;
+	  }
 	}
+
+	nd[j] = max_d;
+	phi[ IDX(i,j) ] = max_state;
       }
 
-      nd[j] = max_d;
-      phi[ IDX(i,j) ] = max_state;
+      swap_d = d;
+      d = nd;
+      nd = swap_d;
     }
-
-    swap_d = d;
-    d = nd;
-    nd = swap_d;
-  }
   
-  int8_t *msp = sample->msp[haplotype];
-  max_state = 0;
-  for(k=1; k < n_subpops; k++)
-    if (d[k] > d[max_state]) max_state = k;
-  double logl = d[max_state];
+    max_state = 0;
+    for(k=1; k < n_subpops; k++)
+      if (d[k] > d[max_state]) max_state = k;
+    logl += d[max_state];
+
+    i = end - 1;
+    path[i] = max_state;
+    while(i > start) {
+      max_state = phi[ IDX(i, max_state) ];
+      path[i-1] = max_state;
+      i--;
+    }
+  }
 
   /* Do not accept the viterbi results if the log likelihood is worse than last
      time. The maximum state path is left as it already is and the previous log
      likelihood returned */
   if (em_iteration > 0 && logl < sample->logl[haplotype]) return sample->logl[haplotype];
   
-  i = n_windows - 1;
-  msp[i] = max_state;
-  while(i > 0) {
-    max_state = phi[ IDX(i, max_state) ];
-    msp[i-1] = max_state;
-    i--;
-  }
+  for(i=0; i < n_windows; i++)
+    if (msp[i] != -1) msp[i] = path[i];
 
   sample->logl[haplotype] = logl;
   return logl;
 }
 
 //#define DEBUG
+/* Sets current_p and sis_p of the windows where the haplotype is analyzed, segment by
+   segment as viterbi() */
 static void forward_backward(sample_t *sample, int haplotype, crf_window_t *crf_windows,
 			     int n_windows, int n_subpops, double w, mm *ma) {
   int i, j, k;
+  int start, end;
   double change, stay;
   
   if (haplotype > 1) return;
 
   double *alpha = (double *) ma->allocate(sizeof(double)*n_subpops*n_windows, WHEREFROM);
-  for(k=0; k < n_subpops; k++)
-    alpha[IDX(0,k)] = DF16(sample->est_p[haplotype][ IDX(0,k) ]);
-  normalize_vector(alpha, n_subpops);
-
-  for(i=1; i < n_windows; i++) {
-    double gd = crf_windows[i].genetic_pos - crf_windows[i-1].genetic_pos;
-    compute_state_change(&stay, &change, gd, rfmix_opts.n_generations, w);
-    for(j=0; j < n_subpops; j++) {
-      alpha[ IDX(i,j) ] = 0.;
-      for(k=0; k < n_subpops; k++)
-	alpha[ IDX(i,j) ] += alpha[ IDX(i-1,k) ]*( (j==k) ? stay : change );
-      alpha[ IDX(i,j) ] = alpha[ IDX(i,j) ]*DF16(sample->est_p[haplotype][ IDX(i,j) ]);
-    }
-    normalize_vector(alpha + i*n_subpops, n_subpops);
-#ifdef DEBUG
-    fprintf(stderr,"sample %s  haplotype %d   window %5d", sample->sample_id, haplotype, i);
+  double *beta = (double *) ma->allocate(sizeof(double)*n_subpops*(n_windows), WHEREFROM);
+  int8_t *msp = sample->msp[haplotype];
+
+  for(start=next_segment(msp, 0, n_windows, &end); start < n_windows;
+      start=next_segment(msp, end, n_windows, &end)) {
     for(k=0; k < n_subpops; k++)
-      fprintf(stderr,"\t%1.3f %1.5f",alpha[ IDX(i,k) ], DF16(sample->est_p[haplotype][ IDX(i,k) ]));
-    fprintf(stderr,"\n");
+      alpha[IDX(start,k)] = DF16(sample->est_p[haplotype][ IDX(start,k) ]);
+    normalize_vector(alpha + start*n_subpops, n_subpops);
+
+    for(i=start+1; i < end; i++) {
+      double gd = crf_windows[i].genetic_pos - crf_windows[i-1].genetic_pos;
+      compute_state_change(&stay, &change, gd, rfmix_opts.n_generations, w);
+      for(j=0; j < n_subpops; j++) {
+	alpha[ IDX(i,j) ] = 0.;
+	for(k=0; k < n_subpops; k++)
+	  alpha[ IDX(i,j) ] += alpha[ IDX(i-1,k) ]*( (j==k) ? stay : change );
+	alpha[ IDX(i,j) ] = alpha[ IDX(i,j) ]*DF16(sample->est_p[haplotype][ IDX(i,j) ]);
+      }
+      normalize_vector(alpha + i*n_subpops, n_subpops);
+#ifdef DEBUG
+      fprintf(stderr,"sample %s  haplotype %d   window %5d", sample->sample_id, haplotype, i);
+      for(k=0; k < n_subpops; k++)
+	fprintf(stderr,"\t%1.3f %1.5f",alpha[ IDX(i,k) ], DF16(sample->est_p[haplotype][ IDX(i,k) ]));
+      fprintf(stderr,"\n");
 #endif      
-  }
+    }
 
-  double *beta = (double *) ma->allocate(sizeof(double)*n_subpops*(n_windows), WHEREFROM);
-  for(k=0; k < n_subpops; k++)
-    beta[ IDX(n_windows-1,k) ] = 1.;
-  normalize_vector(beta + (n_windows-1)*n_subpops, n_subpops);
+    for(k=0; k < n_subpops; k++)
+      beta[ IDX(end-1,k) ] = 1.;
+    normalize_vector(beta + (end-1)*n_subpops, n_subpops);
   
-  for(i=n_windows-2; i >=0 ; i--) {
-    double gd = crf_windows[i+1].genetic_pos - crf_windows[i].genetic_pos;
-    compute_state_change(&stay, &change, gd, rfmix_opts.n_generations, w);
-
-    for(j=0; j < n_subpops; j++) {
-      beta[ IDX(i,j) ] = 0.;
-      for(k=0; k < n_subpops; k++) {
-	beta[ IDX(i,j) ] +=  beta[ IDX(i+1,k) ] * DF16(sample->est_p[haplotype][ IDX(i+1,k) ]) *
-	  ( (j==k) ? stay : change );
+    for(i=end-2; i >= start; i--) {
+      double gd = crf_windows[i+1].genetic_pos - crf_windows[i].genetic_pos;
+      compute_state_change(&stay, &change, gd, rfmix_opts.n_generations, w);
+
+      for(j=0; j < n_subpops; j++) {
+	beta[ IDX(i,j) ] = 0.;
+	for(k=0; k < n_subpops; k++) {
+	  beta[ IDX(i,j) ] +=  beta[ IDX(i+1,k) ] * DF16(sample->est_p[haplotype][ IDX(i+1,k) ]) *
+	    ( (j==k) ? stay : change );
+	}
+	beta[ IDX(i,j) ] = beta[ IDX(i,j) ];
       }
-      beta[ IDX(i,j) ] = beta[ IDX(i,j) ];
-    }
-    normalize_vector(beta + i*n_subpops, n_subpops);
+      normalize_vector(beta + i*n_subpops, n_subpops);
 #ifdef DEBUG
-    fprintf(stderr,"sample %s  haplotype %d   window %5d pos %8.5f", sample->sample_id, haplotype, i,
-	    crf_windows[i].genetic_pos*100.);
-    for(k=0; k < n_subpops; k++)
-      fprintf(stderr,"\t%1.3f",beta[ IDX(i,k) ]);
-    fprintf(stderr,"\n");
+      fprintf(stderr,"sample %s  haplotype %d   window %5d pos %8.5f", sample->sample_id, haplotype, i,
+	      crf_windows[i].genetic_pos*100.);
+      for(k=0; k < n_subpops; k++)
+	fprintf(stderr,"\t%1.3f",beta[ IDX(i,k) ]);
+      fprintf(stderr,"\n");
 #endif
-  }
-
-  for(i=0; i < n_windows; i++) {
-    double p[n_subpops];
-    for(k=0; k < n_subpops; k++) {
-      p[k] = alpha[ IDX(i,k) ]*beta[ IDX(i,k) ];
     }
-    normalize_vector(p, n_subpops);
 
-    for(k=0; k < n_subpops; k++) {
-      //      p[k] /= sum_p;
-      sample->current_p[haplotype][ IDX(i,k) ] = ef16(p[k]);
+    for(i=start; i < end; i++) {
+      double p[n_subpops];
+      for(k=0; k < n_subpops; k++) {
+	p[k] = alpha[ IDX(i,k) ]*beta[ IDX(i,k) ];
+      }
+      normalize_vector(p, n_subpops);
+
+      for(k=0; k < n_subpops; k++) {
+	//      p[k] /= sum_p;
+	sample->current_p[haplotype][ IDX(i,k) ] = ef16(p[k]);
+      }
     }
-  }
 
-  /* Calculate and set Suyash stay-in-state forward-backward probabilities */
-  for(i=0; i < n_windows; i++) {
-    double s = 0.; // stay-in-state
-    double x = 0.; // change state
-    for(int k=0; k < n_subpops; k++) {
-      for(int l=0; l < n_subpops; l++) {
-	if (k == l) {
-	  s +=  alpha[ IDX(i,k) ] * beta[ IDX(i,l) ];
-	} else {
-	  x += alpha[ IDX(i,k) ] * beta[ IDX(i,l) ];
+    /* Calculate and set Suyash stay-in-state forward-backward probabilities */
+    for(i=start; i < end; i++) {
+      double s = 0.; // stay-in-state
+      double x = 0.; // change state
+      for(int k=0; k < n_subpops; k++) {
+	for(int l=0; l < n_subpops; l++) {
+	  if (k == l) {
+	    s +=  alpha[ IDX(i,k) ] * beta[ IDX(i,l) ];
+	  } else {
+	    x += alpha[ IDX(i,k) ] * beta[ IDX(i,l) ];
+	  }
 	}
       }
+      /* s + x should equal 1 (or floating point rounding error close enough), 
+	 but I'll normalize here anyway in case normalization of alpha and
+	 beta changes above */
+      sample->sis_p[haplotype][i] = s/(s+x);
     }
-    /* s + x should equal 1 (or floating point rounding error close enough), 
-       but I'll normalize here anyway in case normalization of alpha and
-       beta changes above */
-    sample->sis_p[haplotype][i] = s/(s+x);
   }
 }
 
-static void *crf_thread(void *targ) {
+static void crf_thread(void *targ, int __attribute__((unused))worker_idx, mm *ma) {
   thread_args_t *args;
   input_t *input;
   int start_sample, end_sample;
-  mm *ma = new mm(64, WHEREFROM);
   double total_logl = 0.;
   double logl;
   
   args = (thread_args_t *) targ;
   input = args->input;
+  ma->recycle();
   
   pthread_mutex_lock(&args->lock);
   for(;;) {
@@ -313,9 +346,6 @@ static void *crf_thread(void *targ) {
   }
   args->viterbi_logl += total_logl;
   pthread_mutex_unlock(&args->lock);
-
-  delete ma;
-  return NULL;
 }
 
 /* Note, does not show viterbi msp for haplotypes 2 and 3, the phase-flip windows */
@@ -338,7 +368,6 @@ static void __attribute__((unused))dump_results(input_t *input) {
 
 double crf(input_t *input, double w) {
   thread_args_t args;
-  pthread_t threads[rfmix_opts.n_threads];
 
   args.next_sample = 0;
   args.samples_completed = 0;
@@ -347,11 +376,8 @@ double crf(input_t *input, double w) {
   args.crf_weight = w;
  
   pthread_mutex_init(&args.lock, NULL);
-  for(int i=0; i < rfmix_opts.n_threads; i++)
-    pthread_create(threads + i, NULL, crf_thread, (void *) &args);
-
-  for(int i=0; i < rfmix_opts.n_threads; i++)
-    pthread_join(threads[i], NULL);
+  run_thread_pool(crf_thread, (void *) &args);
+  pthread_mutex_destroy(&args.lock);
   
 #if 0
   dump_results(input);
@@ -194,6 +194,7 @@ void generate_simulated_samples(input_t *input) {
 	  samples[t].est_p[j][IDX(l,k)] = ef16(0.01/(n_subpops-1));
       }
       MA(samples[t].msp[j], sizeof(int8_t)*n_windows, int8_t);
+      memset(samples[t].msp[j], 0, sizeof(int8_t)*n_windows);
     }
     for(int j=0; j < 2; j++) {
       MA(samples[t].haplotype[j], sizeof(int8_t)*n_snps, int8_t);
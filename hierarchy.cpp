@@ -0,0 +1,395 @@
+/* RFMIX v2.XX - Local Ancestry and Admixture Analysis
+   Bustamante Lab - Stanford School of Medicine
+   (c) 2016 Mark Hamilton Wright
+
+   This program is licensed for academic research use only
+   unless otherwise stated. Contact cdbadmin@stanford.edu for
+   commercial licensing options.
+
+   Academic and research users should cite Brian Maples'
+   paper describing RFMIX in any publication using RFMIX
+   results. Citation is printed when the program is started. */
+
+/* Hierarchical (coarse to fine) analysis. With many reference subpops, most of which
+   are closely related within a few continental groups, a query haplotype is first
+   classified among the groups at the top of the hierarchy, and then only among the
+   children of the group it was assigned to, and so on down to the reference subpops.
+   Each group is analyzed by the usual random forest, CRF and EM on an input of its own
+   (see new_hierarchy_level()), and the results are combined into the loaded input as
+   though it had been analyzed directly: the probability of a subpop is the product of
+   the probabilities of the groups down the path to it, and the viterbi path is the
+   path down the hierarchy. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kmacros.h"
+#include "rfmix.h"
+#include "inputline.h"
+#include "load-input.h"
+#include "hierarchy.h"
+
+extern rfmix_opts_t rfmix_opts;
+
+#define NODE_ALLOC_STEP (16)
+
+static int find_node(hierarchy_t *hier, char *name) {
+  for(int i=1; i < hier->n_nodes; i++)
+    if (strcasecmp(hier->names[i], name) == 0) return i;
+
+  if (hier->n_nodes % NODE_ALLOC_STEP == 0) {
+    RA(hier->names, sizeof(char *)*(hier->n_nodes + NODE_ALLOC_STEP), char *);
+    RA(hier->parent, sizeof(int)*(hier->n_nodes + NODE_ALLOC_STEP), int);
+    RA(hier->subpop, sizeof(int)*(hier->n_nodes + NODE_ALLOC_STEP), int);
+  }
+  hier->names[hier->n_nodes] = strdup(name);
+  hier->parent[hier->n_nodes] = -2; // not yet given
+  hier->subpop[hier->n_nodes] = -1;
+  return hier->n_nodes++;
+}
+
+static void add_levels(hierarchy_t *hier, int node) {
+  if (hier->n_children[node] > 1)
+    hier->levels[hier->n_levels++] = node;
+  for(int c=0; c < hier->n_children[node]; c++)
+    add_levels(hier, hier->children[node][c]);
+}
+
+/* A group with only one child has nothing to classify, so paths pass straight down
+   through it */
+static int descend(hierarchy_t *hier, int node) {
+  while(hier->n_children[node] == 1) node = hier->children[node][0];
+  return node;
+}
+
+/* The index of the child of group g that node is, or is under, -1 if not under g */
+static int child_toward(hierarchy_t *hier, int g, int node) {
+  while(node > 0 && hier->parent[node] != g) node = hier->parent[node];
+  if (node <= 0) return -1;
+
+  for(int c=0; c < hier->n_children[g]; c++)
+    if (hier->children[g][c] == node) return c;
+  return -1;
+}
+
+/* Reads the hierarchy file, lines of a reference subpop or group name and the name of
+   its parent group separated by a tab. Subpops and groups not given a parent are
+   children of the root, so a file of only the reference subpops' groups is a two level
+   hierarchy. */
+hierarchy_t *read_hierarchy(char *fname, input_t *input) {
+  hierarchy_t *hier;
+  char *p, *name, *parent_name;
+  int stop = 0;
+
+  MA(hier, sizeof(hierarchy_t), hierarchy_t);
+  hier->n_nodes = 0;
+  hier->names = NULL;
+  hier->parent = NULL;
+  hier->subpop = NULL;
+  hier->path = NULL;
+
+  find_node(hier, (char *) "(root)");
+  hier->parent[0] = -1;
+  for(int k=0; k < input->n_subpops; k++) {
+    int node = find_node(hier, input->reference_subpops[k]);
+    hier->subpop[node] = k;
+  }
+
+  Inputline *f = new Inputline(fname, rfmix_opts.chromosome);
+  while((p = f->nextline(INPUTLINE_NOCOPY)) != NULL) {
+    CHOMP(p);
+    if (p[0] == 0 || p[0] == '#') continue;
+
+    name = strsep(&p, "\t");
+    parent_name = strsep(&p, "\t");
+    if (name[0] == 0 || parent_name == NULL || parent_name[0] == 0) {
+      fprintf(stderr,"Error: line %d of hierarchy file %s is not <subpop or group>\t<parent group>\n",
+	      f->line_no, fname);
+      exit(-1);
+    }
+
+    int node = find_node(hier, name);
+    int parent = find_node(hier, parent_name);
+    if (hier->subpop[parent] != -1) {
+      fprintf(stderr,"Error: hierarchy file %s gives reference subpop %s as the parent of %s\n",
+	      fname, parent_name, name);
+      exit(-1);
+    }
+    if (hier->parent[node] != -2 && hier->parent[node] != parent) {
+      fprintf(stderr,"Error: hierarchy file %s gives %s more than one parent group\n",
+	      fname, name);
+      exit(-1);
+    }
+    hier->parent[node] = parent;
+  }
+  delete f;
+
+  for(int i=1; i < hier->n_nodes; i++)
+    if (hier->parent[i] == -2) hier->parent[i] = 0;
+
+  /* Every node must lead up to the root, within as many steps as there are nodes */
+  for(int i=1; i < hier->n_nodes; i++) {
+    int node = i;
+    for(int j=0; node > 0 && j < hier->n_nodes; j++) node = hier->parent[node];
+    if (node != 0) {
+      fprintf(stderr,"\nHierarchy group %s is its own ancestor", hier->names[i]);
+      stop = 1;
+    }
+  }
+  if (stop) {
+    fprintf(stderr,"\n");
+    exit(-1);
+  }
+
+  MA(hier->n_children, sizeof(int)*hier->n_nodes, int);
+  MA(hier->children, sizeof(int *)*hier->n_nodes, int *);
+  for(int i=0; i < hier->n_nodes; i++) hier->n_children[i] = 0;
+  for(int i=1; i < hier->n_nodes; i++) hier->n_children[ hier->parent[i] ]++;
+  for(int i=0; i < hier->n_nodes; i++) {
+    hier->children[i] = NULL;
+    if (hier->n_children[i] > 0)
+      MA(hier->children[i], sizeof(int)*hier->n_children[i], int);
+    hier->n_children[i] = 0;
+  }
+  for(int i=1; i < hier->n_nodes; i++) {
+    int parent = hier->parent[i];
+    hier->children[parent][ hier->n_children[parent]++ ] = i;
+  }
+
+  /* A group with no subpops under it is most likely a misspelled subpop name */
+  for(int i=1; i < hier->n_nodes; i++) {
+    if (hier->subpop[i] == -1 && hier->n_children[i] == 0) {
+      fprintf(stderr,"\nHierarchy file %s: %s is neither a reference subpop nor a group of them",
+	      fname, hier->names[i]);
+      stop = 1;
+    }
+  }
+  if (stop) {
+    fprintf(stderr,"\n");
+    exit(-1);
+  }
+
+  MA(hier->levels, sizeof(int)*hier->n_nodes, int);
+  hier->n_levels = 0;
+  add_levels(hier, 0);
+
+  return hier;
+}
+
+void free_hierarchy(hierarchy_t *hier) {
+  for(int i=0; i < hier->n_nodes; i++) {
+    free(hier->names[i]);
+    if (hier->children[i]) free(hier->children[i]);
+  }
+  free(hier->names);
+  free(hier->parent);
+  free(hier->subpop);
+  free(hier->n_children);
+  free(hier->children);
+  free(hier->levels);
+  free(hier);
+}
+
+static int is_query(sample_t *sample) {
+  return sample->apriori_subpop == -1 && sample->s_sample == 0;
+}
+
+/* Starts the query samples' paths at the root, and their subpop and stay-in-state
+   probabilities at 1.0 to be multiplied by those of each group analyzed */
+void init_hierarchy_estimates(hierarchy_t *hier, input_t *input) {
+  int n_subpops = input->n_subpops;
+  int start = descend(hier, 0);
+
+  MA(hier->path, sizeof(int16_t *)*input->n_samples*2, int16_t *);
+  for(int i=0; i < input->n_samples; i++) {
+    sample_t *sample = input->samples + i;
+    for(int h=0; h < 2; h++) {
+      hier->path[2*i+h] = NULL;
+      if (!is_query(sample)) continue;
+
+      MA(hier->path[2*i+h], sizeof(int16_t)*input->n_windows, int16_t);
+      for(int w=0; w < input->n_windows; w++) {
+	hier->path[2*i+h][w] = start;
+	sample->sis_p[h][w] = 1.0;
+	for(int k=0; k < n_subpops; k++)
+	  sample->current_p[h][ IDX(w,k) ] = ef16(1.0);
+      }
+    }
+  }
+
+  for(int w=0; w < input->n_windows; w++)
+    input->crf_windows[w].n_trees = 0;
+}
+
+/* The query samples' viterbi paths are the reference subpops their paths ended at */
+void finish_hierarchy_estimates(hierarchy_t *hier, input_t *input) {
+  for(int i=0; i < input->n_samples; i++) {
+    sample_t *sample = input->samples + i;
+    for(int h=0; h < 2; h++) {
+      if (hier->path[2*i+h] == NULL) continue;
+      for(int w=0; w < input->n_windows; w++)
+	sample->msp[h][w] = hier->subpop[ hier->path[2*i+h][w] ];
+      free(hier->path[2*i+h]);
+    }
+  }
+  free(hier->path);
+  hier->path = NULL;
+}
+
+/* Marks the viterbi paths of the group's query haplotypes -1 in the windows where they
+   were not assigned to the group, phase flipped haplotypes by the haplotype they 
+   start from. The random forest and the CRF only analyze a haplotype in the other
+   windows, and EM only adds it to the group's reference where it is of the group's
+   ancestry (see setup_ref_haplotypes()) */
+static void restrict_hierarchy_level(hierarchy_t *hier, hierarchy_level_t *level) {
+  input_t *li = level->input;
+
+  for(int i=0; i < li->n_samples; i++) {
+    sample_t *sample = li->samples + i;
+    if (!is_query(sample)) continue;
+
+    int16_t **path = hier->path + 2*level->sample_map[i];
+    for(int h=0; h < 4; h++)
+      for(int w=0; w < li->n_windows; w++)
+	if (path[h & 0x1][w] != level->node)
+	  sample->msp[h][w] = -1;
+  }
+}
+
+/* Sets up the input for analyzing group node. A query sample is included if either of
+   its haplotypes was assigned to the group in any window, and each haplotype is only
+   analyzed in the windows where it was (see restrict_hierarchy_level()). */
+hierarchy_level_t *new_hierarchy_level(hierarchy_t *hier, input_t *input, int node) {
+  hierarchy_level_t *level;
+  input_t *li;
+  int n = hier->n_children[node];
+
+  MA(level, sizeof(hierarchy_level_t), hierarchy_level_t);
+  level->node = node;
+  level->n_queries = 0;
+
+  MA(li, sizeof(input_t), input_t);
+  *li = *input;
+  li->n_subpops = n;
+  MA(li->reference_subpops, sizeof(char *)*n, char *);
+  for(int c=0; c < n; c++)
+    li->reference_subpops[c] = hier->names[ hier->children[node][c] ];
+  MA(li->crf_windows, sizeof(crf_window_t)*input->n_windows, crf_window_t);
+  memcpy(li->crf_windows, input->crf_windows, sizeof(crf_window_t)*input->n_windows);
+
+  MA(li->samples, sizeof(sample_t)*input->n_samples, sample_t);
+  MA(level->sample_map, sizeof(int)*input->n_samples, int);
+  li->n_samples = 0;
+  for(int i=0; i < input->n_samples; i++) {
+    sample_t *sample = input->samples + i;
+    int label = -1;
+
+    if (sample->s_sample == 1) continue;
+    if (sample->apriori_subpop != -1) {
+      label = child_toward(hier, node, sample->apriori_subpop + 1);
+      if (label == -1) continue;
+    } else {
+      int assigned = 0;
+      for(int h=0; h < 2 && !assigned; h++)
+	for(int w=0; w < input->n_windows && !assigned; w++)
+	  if (hier->path[2*i+h][w] == node) assigned = 1;
+      if (!assigned) continue;
+      level->n_queries++;
+    }
+
+    sample_t *copy = li->samples + li->n_samples;
+    *copy = *sample;
+    copy->apriori_subpop = label;
+    copy->s_parent = 0;
+    for(int h=0; h < 2; h++) {
+      copy->current_p[h] = NULL;
+      copy->sis_p[h] = NULL;
+      copy->ksp[h] = NULL;
+    }
+    for(int h=0; h < 4; h++) {
+      copy->est_p[h] = NULL;
+      copy->msp[h] = NULL;
+    }
+    level->sample_map[li->n_samples++] = i;
+  }
+
+  init_sample_estimates(li);
+  level->input = li;
+  restrict_hierarchy_level(hier, level);
+  return level;
+}
+
+/* Multiplies the group's results into the loaded input's query samples: the
+   probability of each reference subpop under a child is multiplied by the child's
+   probability where the haplotype was assigned to the group, or 1/n_children where it
+   was not, and the path moves to the child of the group's viterbi path */
+void combine_hierarchy_level(hierarchy_t *hier, input_t *input, hierarchy_level_t *level) {
+  input_t *li = level->input;
+  int node = level->node;
+  int n = hier->n_children[node];
+  int n_subpops = input->n_subpops;
+  int leaf_child[n_subpops];
+  int *level_idx;
+
+  for(int k=0; k < n_subpops; k++)
+    leaf_child[k] = child_toward(hier, node, k + 1);
+
+  MA(level_idx, sizeof(int)*input->n_samples, int);
+  for(int i=0; i < input->n_samples; i++) level_idx[i] = -1;
+  for(int i=0; i < li->n_samples; i++)
+    if (is_query(li->samples + i)) level_idx[ level->sample_map[i] ] = i;
+
+  for(int i=0; i < input->n_samples; i++) {
+    sample_t *sample = input->samples + i;
+    if (!is_query(sample)) continue;
+    sample_t *lsample = level_idx[i] == -1 ? NULL : li->samples + level_idx[i];
+
+    for(int h=0; h < 2; h++) {
+      int16_t *path = hier->path[2*i+h];
+      for(int w=0; w < input->n_windows; w++) {
+	if (lsample != NULL && path[w] == node) {
+	  for(int k=0; k < n_subpops; k++) {
+	    if (leaf_child[k] == -1) continue;
+	    double p = DF16(lsample->current_p[h][ w*n + leaf_child[k] ]);
+	    sample->current_p[h][ IDX(w,k) ] = ef16(DF16(sample->current_p[h][ IDX(w,k) ]) * p);
+	  }
+	  sample->sis_p[h][w] *= lsample->sis_p[h][w];
+	  path[w] = descend(hier, hier->children[node][ lsample->msp[h][w] ]);
+	} else {
+	  for(int k=0; k < n_subpops; k++) {
+	    if (leaf_child[k] == -1) continue;
+	    sample->current_p[h][ IDX(w,k) ] = ef16(DF16(sample->current_p[h][ IDX(w,k) ]) / n);
+	  }
+	}
+      }
+    }
+  }
+  free(level_idx);
+
+  for(int w=0; w < input->n_windows; w++)
+    input->crf_windows[w].n_trees += li->crf_windows[w].n_trees;
+}
+
+void free_hierarchy_level(hierarchy_level_t *level) {
+  input_t *li = level->input;
+
+  for(int i=0; i < li->n_samples; i++) {
+    sample_t *sample = li->samples + i;
+    /* The internally simulated samples are the group input's own */
+    if (sample->s_sample == 1) {
+      for(int h=0; h < 2; h++) {
+	free(sample->haplotype[h]);
+	if (sample->ksp[h]) free(sample->ksp[h]);
+      }
+      free(sample->sample_id);
+    }
+    free_sample_estimates(sample);
+  }
+  free(li->samples);
+  free(li->reference_subpops);
+  free(li->crf_windows);
+  free(li);
+  free(level->sample_map);
+  free(level);
+}
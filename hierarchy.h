@@ -0,0 +1,62 @@
+/* RFMIX v2.XX - Local Ancestry and Admixture Analysis
+   Bustamante Lab - Stanford School of Medicine
+   (c) 2016 Mark Hamilton Wright
+
+   This program is licensed for academic research use only
+   unless otherwise stated. Contact cdbadmin@stanford.edu for
+   commercial licensing options.
+
+   Academic and research users should cite Brian Maples'
+   paper describing RFMIX in any publication using RFMIX
+   results. Citation is printed when the program is started. */
+
+#ifndef HIERARCHY_H
+#define HIERARCHY_H
+
+#include <stdint.h>
+#include "rfmix.h"
+
+/* A tree of groups over the reference subpops, read from the --hierarchy file. Node 0
+   is the implicit root, nodes 1 through n_subpops are the reference subpops in subpop
+   index order and the rest are the groups named in the file. levels[] are the groups
+   with two or more children in preorder, each analyzed as a subpop classification of
+   its children in turn.
+
+   path[2*i+h][w] is the node haplotype h of query sample i has been assigned to at
+   CRF window w so far, starting at the root and moving one level down with each group
+   analyzed, ending at a reference subpop. */
+typedef struct {
+  int n_nodes;
+  char **names;
+  int *parent;     // -1 for the root
+  int *subpop;     // reference subpop index of a leaf, -1 for a group
+  int *n_children;
+  int **children;
+
+  int n_levels;
+  int *levels;
+
+  int16_t **path;
+} hierarchy_t;
+
+/* The input for analyzing one group: the reference samples under the group labelled
+   by which child they are under, and the query samples assigned to the group in any
+   window. Samples share the haplotypes of the loaded input, but have their own EM
+   arrays. sample_map[] gives the loaded input's index of each sample, -1 for the
+   internally simulated samples */
+typedef struct {
+  int node;
+  int n_queries;
+  input_t *input;
+  int *sample_map;
+} hierarchy_level_t;
+
+hierarchy_t *read_hierarchy(char *fname, input_t *input);
+void free_hierarchy(hierarchy_t *hier);
+void init_hierarchy_estimates(hierarchy_t *hier, input_t *input);
+void finish_hierarchy_estimates(hierarchy_t *hier, input_t *input);
+hierarchy_level_t *new_hierarchy_level(hierarchy_t *hier, input_t *input, int node);
+void combine_hierarchy_level(hierarchy_t *hier, input_t *input, hierarchy_level_t *level);
+void free_hierarchy_level(hierarchy_level_t *level);
+
+#endif
@@ -23,6 +23,8 @@
 #include "load-input.h"
 #include "inputline.h"
 #include "hash-table.h"
+#include "random-forest.h"
+#include "model.h"
 
 extern rfmix_opts_t rfmix_opts;
 
@@ -61,55 +63,15 @@ static int8_t get_allele(char q) {
   }
 }
 
-static void load_samples(input_t *input) {
-  sample_t *samples;
-  int n_samples, i, ref_idx, *tmp;
+/* Adds the reference samples named in the sample map and present in the reference VCF
+   to samples[], and sets up the reference subpops */
+static void load_reference_samples(input_t *input, sample_t **rsamples, int *rn_samples,
+				   HashTable *sample_hash) {
+  sample_t *samples = *rsamples;
+  int n_samples = *rn_samples;
+  int i, ref_idx, *tmp;
   char *sample_id, *reference_pop, *p;
-
-  input->reference_subpops = NULL;
-  input->n_subpops = 0;
-  
-  /* This will be used to rapidly locate a sample when matching the reference VCF file 
-     to the sample ids loaded from the sample map file. Any sample_id found in the VCF
-     sample header line that is not defined in the sample map file will be excluded.
-     The need for the hash table is perceived in the case the reference file has a very
-     large number of samples (thousands). The integer index to the samples array is
-     the data value stored in the hash table, because the samples array may be
-     copied to a new location when extended by RA() (realloc). */
-  HashTable *sample_hash = new HashTable(256);
   HashTable *tmp_hash = new HashTable(256); // used to check if sample defined in sample map is in reference VCF
-  samples = NULL;
-  n_samples = 0;
-  
-  /* All samples in the query VCF file will be analyzed, and are not expected to be
-     named in the seperate sample map file. Grab them from the VCF header and add
-     them to the sample array first */
-  Inputline *qvcf = new Inputline(rfmix_opts.qvcf_fname, rfmix_opts.chromosome);
-  p = vcf_skip_headers(qvcf);
-
-  CHOMP(p);
-  for(i=0; i < 9; i++) strsep(&p, "\t");
-  while((sample_id = strsep(&p, "\t")) != NULL) {
-    if (n_samples % SAMPLE_ALLOC_STEP == 0)
-      RA(samples, sizeof(sample_t)*(SAMPLE_ALLOC_STEP + n_samples), sample_t);
-	
-    samples[n_samples].sample_id = strdup(sample_id);
-    samples[n_samples].apriori_subpop = -1;
-    samples[n_samples].s_parent = 0;
-    samples[n_samples].s_sample = 0;
-
-    if (sample_hash->lookup(sample_id) != NULL) {
-      fprintf(stderr,"Error: Sample id %s occurs twice or more in input - samples must have unique identifiers both within and across query and reference\n", sample_id);
-      exit(-1);
-    }
-    
-    MA(tmp, sizeof(int), int);
-    *tmp = n_samples;
-    sample_hash->insert(sample_id, tmp);
-    
-    n_samples++;
-  }
-  delete qvcf; 
 
   /* Parse up the column header from the reference VCF to see what reference
      samples are actually in the file. Then, we will only define a sample in
@@ -227,7 +189,68 @@ static void load_samples(input_t *input) {
     n_samples++;
   }
   delete f;
+  delete tmp_hash;
+
+  *rsamples = samples;
+  *rn_samples = n_samples;
+}
+
+static void load_samples(input_t *input) {
+  sample_t *samples;
+  int n_samples, i, *tmp;
+  char *sample_id, *p;
+
+  input->reference_subpops = NULL;
+  input->n_subpops = 0;
+  
+  /* This will be used to rapidly locate a sample when matching the reference VCF file 
+     to the sample ids loaded from the sample map file. Any sample_id found in the VCF
+     sample header line that is not defined in the sample map file will be excluded.
+     The need for the hash table is perceived in the case the reference file has a very
+     large number of samples (thousands). The integer index to the samples array is
+     the data value stored in the hash table, because the samples array may be
+     copied to a new location when extended by RA() (realloc). */
+  HashTable *sample_hash = new HashTable(256);
+  samples = NULL;
+  n_samples = 0;
   
+  /* All samples in the query VCF file will be analyzed, and are not expected to be
+     named in the seperate sample map file. Grab them from the VCF header and add
+     them to the sample array first. There are none for rfmix train. */
+  Inputline *qvcf = NULL;
+  p = NULL;
+  if (rfmix_opts.command != RFMIX_TRAIN) {
+    qvcf = new Inputline(rfmix_opts.qvcf_fname, rfmix_opts.chromosome);
+    p = vcf_skip_headers(qvcf);
+    CHOMP(p);
+    for(i=0; i < 9; i++) strsep(&p, "\t");
+  }
+  while(p != NULL && (sample_id = strsep(&p, "\t")) != NULL) {
+    if (n_samples % SAMPLE_ALLOC_STEP == 0)
+      RA(samples, sizeof(sample_t)*(SAMPLE_ALLOC_STEP + n_samples), sample_t);
+	
+    samples[n_samples].sample_id = strdup(sample_id);
+    samples[n_samples].apriori_subpop = -1;
+    samples[n_samples].s_parent = 0;
+    samples[n_samples].s_sample = 0;
+
+    if (sample_hash->lookup(sample_id) != NULL) {
+      fprintf(stderr,"Error: Sample id %s occurs twice or more in input - samples must have unique identifiers both within and across query and reference\n", sample_id);
+      exit(-1);
+    }
+    
+    MA(tmp, sizeof(int), int);
+    *tmp = n_samples;
+    sample_hash->insert(sample_id, tmp);
+    
+    n_samples++;
+  }
+  if (qvcf != NULL) delete qvcf; 
+
+  /* With rfmix apply, there is no reference panel */
+  if (rfmix_opts.command != RFMIX_APPLY)
+    load_reference_samples(input, &samples, &n_samples, sample_hash);
+
   /* initialize to empty/null values all other sample struct fields */
   for(i=0; i < n_samples; i++) {
     samples[i].s_sample = 0;
@@ -259,8 +282,6 @@ static void load_samples(input_t *input) {
   input->samples = samples;
   input->n_samples = n_samples;
   input->sample_hash = sample_hash;
-
-  delete tmp_hash;
 }
 
 static void skip_to_chromosome(Inputline *vcf, char *chm) {
@@ -359,12 +380,17 @@ static char *get_next_snp(Inputline *vcf, char **chm, int *pos) {
   return p;
 }
 
+/* Finds the SNPs in both the query and reference VCFs, or for rfmix train, in the
+   reference VCF, that pass the missing data filter */
 static void identify_common_snps(input_t *input) {
   char *pq, *pr;
   
-  Inputline *qvcf = new Inputline(rfmix_opts.qvcf_fname, rfmix_opts.chromosome);
-  vcf_skip_headers(qvcf);
-  skip_to_chromosome(qvcf, rfmix_opts.chromosome);
+  Inputline *qvcf = NULL;
+  if (rfmix_opts.command != RFMIX_TRAIN) {
+    qvcf = new Inputline(rfmix_opts.qvcf_fname, rfmix_opts.chromosome);
+    vcf_skip_headers(qvcf);
+    skip_to_chromosome(qvcf, rfmix_opts.chromosome);
+  }
   
   Inputline *rvcf = new Inputline(rfmix_opts.rvcf_fname, rfmix_opts.chromosome);
   vcf_skip_headers(rvcf);
@@ -375,16 +401,20 @@ static void identify_common_snps(input_t *input) {
   char *q_chm, *r_chm;
   int q_pos, r_pos;
   
-  pq = get_next_snp(qvcf, &q_chm, &q_pos);
+  pq = qvcf != NULL ? get_next_snp(qvcf, &q_chm, &q_pos) : NULL;
   pr = get_next_snp(rvcf, &r_chm, &r_pos);
 
   double maf, miss;
   int mac;
   for(;;) {
-    while(q_pos != -1 && strcmp(q_chm, rfmix_opts.chromosome) == 0 &&
-	  q_pos < r_pos)
-      pq = get_next_snp(qvcf, &q_chm, &q_pos);
-    if (q_pos == -1 || strcmp(q_chm, rfmix_opts.chromosome) != 0) break;
+    if (qvcf != NULL) {
+      while(q_pos != -1 && strcmp(q_chm, rfmix_opts.chromosome) == 0 &&
+	    q_pos < r_pos)
+	pq = get_next_snp(qvcf, &q_chm, &q_pos);
+      if (q_pos == -1 || strcmp(q_chm, rfmix_opts.chromosome) != 0) break;
+    } else {
+      q_pos = r_pos;
+    }
 
     while(r_pos != -1 && strcmp(r_chm, rfmix_opts.chromosome) == 0 &&
 	  r_pos < q_pos)
@@ -392,37 +422,30 @@ static void identify_common_snps(input_t *input) {
     if (r_pos == -1 || strcmp(r_chm, rfmix_opts.chromosome) != 0) break;
 
     if (q_pos == r_pos) {
-      if (q_pos < rfmix_opts.analyze_range[0] || q_pos > rfmix_opts.analyze_range[1]) {
-	pq = get_next_snp(qvcf, &q_chm, &q_pos);      
-	pr = get_next_snp(rvcf, &r_chm, &r_pos);
-	continue;
-      }
+      int include = q_pos >= rfmix_opts.analyze_range[0] && q_pos <= rfmix_opts.analyze_range[1];
       
       /* Discard SNPs with too much missing data in either the query or the
 	 reference files. If desired, insert minor allele frequency or minor
          allele count filters here */
-      maf = vcf_snp_maf(&mac, &miss, pq);
-      if (miss > rfmix_opts.maximum_missing_data_freq) {
-	pq = get_next_snp(qvcf, &q_chm, &q_pos);      
-	pr = get_next_snp(rvcf, &r_chm, &r_pos);
-	continue;
+      if (include && qvcf != NULL) {
+	maf = vcf_snp_maf(&mac, &miss, pq);
+	if (miss > rfmix_opts.maximum_missing_data_freq) include = 0;
       }
-
-      maf = vcf_snp_maf(&mac, &miss, pr);
-      if (miss > rfmix_opts.maximum_missing_data_freq) {
-	pq = get_next_snp(qvcf, &q_chm, &q_pos);      
-	pr = get_next_snp(rvcf, &r_chm, &r_pos);
-	continue;
+      if (include) {
+	maf = vcf_snp_maf(&mac, &miss, pr);
+	if (miss > rfmix_opts.maximum_missing_data_freq) include = 0;
       }
       
-      if (n_snps % SNP_ALLOC_STEP == 0)
-	RA(snps, sizeof(snp_t)*(n_snps + SNP_ALLOC_STEP), snp_t);
-      snps[n_snps].pos = q_pos;
-      snps[n_snps].genetic_pos = input->genetic_map->translate_seqpos(q_pos);
-      snps[n_snps].crf_index = -1;
-      n_snps++;
-
-      pq = get_next_snp(qvcf, &q_chm, &q_pos);      
+      if (include) {
+	if (n_snps % SNP_ALLOC_STEP == 0)
+	  RA(snps, sizeof(snp_t)*(n_snps + SNP_ALLOC_STEP), snp_t);
+	snps[n_snps].pos = q_pos;
+	snps[n_snps].genetic_pos = input->genetic_map->translate_seqpos(q_pos);
+	snps[n_snps].crf_index = -1;
+	n_snps++;
+      }
+
+      if (qvcf != NULL) pq = get_next_snp(qvcf, &q_chm, &q_pos);      
       pr = get_next_snp(rvcf, &r_chm, &r_pos);
     }
   }
@@ -430,7 +453,7 @@ static void identify_common_snps(input_t *input) {
   input->snps = snps;
   input->n_snps = n_snps;
 
-  delete qvcf;
+  if (qvcf != NULL) delete qvcf;
   delete rvcf;
 }
 
@@ -465,18 +488,23 @@ static int vcf_parse_column_header(vcf_column_map_t **rcolumn_map, char *column_
   return n_cols;
 }
 
-static void parse_alleles(input_t *input, Inputline *vcf, vcf_column_map_t *column_map,
-			  int n_cols) {
+/* Loads the alleles of the VCF's samples at input's SNPs, returning the number of 
+   SNPs found in the VCF. Alleles at SNPs not in the VCF, which is only possible with
+   rfmix apply, are left as they are (missing) */
+static int parse_alleles(input_t *input, Inputline *vcf, vcf_column_map_t *column_map,
+			 int n_cols) {
   char *p, *q;
   char *chm;
   int pos;
 
   int snp_idx = 0;
+  int n_found = 0;
   int n_unphased = 0;
   while(snp_idx < input->n_snps &&
 	(p = get_next_snp(vcf, &chm, &pos)) != NULL &&
 	strcmp(chm, rfmix_opts.chromosome) == 0) {
-    if (input->snps[snp_idx].pos != pos) continue;
+    while(snp_idx < input->n_snps && input->snps[snp_idx].pos < pos) snp_idx++;
+    if (snp_idx == input->n_snps || input->snps[snp_idx].pos != pos) continue;
 
     int col_idx = VCF_LEAD_COLS;
     while(col_idx < n_cols && (q = strsep(&p, "\t")) != NULL) {
@@ -499,29 +527,40 @@ static void parse_alleles(input_t *input, Inputline *vcf, vcf_column_map_t *colu
       col_idx++;
     }
     snp_idx++;
+    n_found++;
   }
 
   if (n_unphased > 0) {
     fprintf(stderr,"\nWarning: %s - %d unphased genotypes treated as phased\n", vcf->fname, n_unphased);
   }
+
+  return n_found;
 }
 
 static void load_alleles(input_t *input) {
-  Inputline *qvcf = new Inputline(rfmix_opts.qvcf_fname, rfmix_opts.chromosome);
-  char *sample_header = vcf_skip_headers(qvcf);
-
   vcf_column_map_t *column_map;
-  int n_cols = vcf_parse_column_header(&column_map, sample_header, input);
-
-  skip_to_chromosome(qvcf, rfmix_opts.chromosome);
-  parse_alleles(input, qvcf, column_map, n_cols);
-
-  delete qvcf;
-  for(int i=0; i < n_cols; i++) {
-    if (column_map[i].sample_id) free(column_map[i].sample_id);
+  char *sample_header;
+  int n_cols;
+  
+  if (rfmix_opts.command != RFMIX_TRAIN) {
+    Inputline *qvcf = new Inputline(rfmix_opts.qvcf_fname, rfmix_opts.chromosome);
+    sample_header = vcf_skip_headers(qvcf);
+    n_cols = vcf_parse_column_header(&column_map, sample_header, input);
+
+    skip_to_chromosome(qvcf, rfmix_opts.chromosome);
+    int n_found = parse_alleles(input, qvcf, column_map, n_cols);
+    if (rfmix_opts.command == RFMIX_APPLY && n_found < input->n_snps)
+      fprintf(stderr,"\nNOTICE: %d of the model's %d SNPs are not in %s and are treated as missing data\n",
+	      input->n_snps - n_found, input->n_snps, qvcf->fname);
+
+    delete qvcf;
+    for(int i=0; i < n_cols; i++) {
+      if (column_map[i].sample_id) free(column_map[i].sample_id);
+    }
+    free(column_map);
+    n_cols = 0;
   }
-  free(column_map);
-  n_cols = 0;
+  if (rfmix_opts.command == RFMIX_APPLY) return;
 
   Inputline *rvcf = new Inputline(rfmix_opts.rvcf_fname, rfmix_opts.chromosome);
   sample_header = vcf_skip_headers(rvcf);
@@ -601,12 +640,10 @@ static void layout_random_forest(crf_window_t *crf, int n_crf, snp_t *snps, int
   }
   
 }
-static void set_crf_points(input_t *input) {
+static void set_crf_windows(input_t *input) {
 
   fprintf(stderr,"\n   setting up CRF points and random forest windows... ");
 
-  /* Local variable is needed for IDX(window,subpop) macro */
-  int n_subpops = input->n_subpops;
   snp_t *snps = input->snps;
   int n_snps = input->n_snps;
   
@@ -664,20 +701,36 @@ static void set_crf_points(input_t *input) {
   layout_random_forest(input->crf_windows, input->n_windows, snps, n_snps, rfmix_opts.rf_window_size);
   /* Convert cM to M as we will always need in M in the CRF */
   for(w=0; w < input->n_windows; w++) input->crf_windows[w].genetic_pos /= 100.;
-  
+}
+
+/* Allocates and initializes the per sample, per CRF window arrays of the EM. This is
+   also used by the hierarchical analysis for each group's own input (see hierarchy.cpp),
+   whose samples share the haplotypes of the loaded input but not these arrays. */
+void init_sample_estimates(input_t *input) {
+  /* Local variable is needed for IDX(window,subpop) macro */
+  int n_subpops = input->n_subpops;
+
   /* Set up and initialize the current (starting) marginal probabilities for subpop
      assignment for each haplotype at each CRF window. These values start as 100%
      probability the haplotypes are from the apriori subpopulation for reference
      individuals, and just initialized to zero for all query individuals. These are
      calculated at each EM iteration by the Forward-Backward algorithm in the
-     conditional random field code */
+     conditional random field code. Every sample needs current_p[] and msp[0..1] as
+     reference haplotypes are drawn from them, but only samples that are actually 
+     analyzed (query samples, or all samples with --reanalyze-reference) need the
+     random forest estimates, the phase-flip paths and the stay-in-state 
+     probabilities. With large reference panels and few query samples, those arrays
+     would otherwise be most of the memory used and never touched. */
   fprintf(stderr,"\n   initializing apriori reference subpop across CRF... ");
   for(int k=0; k < input->n_samples; k++) {
     sample_t *sample = input->samples + k;
+    int analyzed = sample->apriori_subpop == -1 || rfmix_opts.reanalyze_reference != 0;
     
     for(int h=0; h < 2; h++) {
       MA(sample->current_p[h], sizeof(int16_t)*input->n_windows*n_subpops, int16_t);
-      MA(sample->sis_p[h], sizeof(float)*input->n_windows*n_subpops, float);
+      /* one stay-in-state probability per CRF window, not per window and subpop */
+      if (analyzed)
+	MA(sample->sis_p[h], sizeof(float)*input->n_windows, float);
 
       for(int i=0; i < input->n_windows; i++) {	
 	for(int s=0; s < n_subpops; s++)
@@ -692,41 +745,80 @@ static void set_crf_points(input_t *input) {
   fprintf(stderr,"\n   setting up random forest probability estimation arrays... ");
   for(int k=0; k < input->n_samples; k++) {
     sample_t *sample = input->samples + k;
-
-    for(int h=0; h < 4; h++) {
+    int analyzed = sample->apriori_subpop == -1 || rfmix_opts.reanalyze_reference != 0;
+
+    /* msp[2] and msp[3] are the viterbi paths for the phase-flip haplotypes and
+       est_p[] only receives random forest results, both only for analyzed samples.
+       Query haplotypes start on subpop 0 until the CRF gives them a path, as a path
+       of -1 marks the windows a haplotype is not analyzed in (see 
+       restrict_hierarchy_level()) */
+    for(int h=0; h < (analyzed ? 4 : 2); h++) {
       MA(sample->msp[h], sizeof(int8_t)*input->n_windows, int8_t);
       for(int i=0; i < input->n_windows; i++)
-	sample->msp[h][i] = sample->apriori_subpop;
+	sample->msp[h][i] = sample->apriori_subpop == -1 ? 0 : sample->apriori_subpop;
+    }
 
-      MA(sample->est_p[h], sizeof(int16_t)*input->n_windows*n_subpops, int16_t);
+    if (analyzed) {
+      for(int h=0; h < 4; h++)
+	MA(sample->est_p[h], sizeof(int16_t)*input->n_windows*n_subpops, int16_t);
     }
   }
   fprintf(stderr,"done\n");
 }
 
-input_t *load_input(void) {
+void free_sample_estimates(sample_t *sample) {
+  for(int h=0; h < 2; h++) {
+    free(sample->current_p[h]);
+    if (sample->sis_p[h]) free(sample->sis_p[h]);
+  }
+  for(int h=0; h < 4; h++) {
+    if (sample->est_p[h]) free(sample->est_p[h]);
+    if (sample->msp[h]) free(sample->msp[h]);
+  }
+}
+
+/* Sets up the CRF windows, unless they were read from a model, and the arrays of
+   estimates for each sample over them */
+static void set_crf_points(input_t *input) {
+  if (rfmix_opts.command != RFMIX_APPLY) set_crf_windows(input);
+  init_sample_estimates(input);
+}
+
+/* Loads the query samples and reference panel, or with rfmix train the reference 
+   panel only, or with rfmix apply the query samples with the SNPs, windows and 
+   subpops of the model */
+input_t *load_input(rf_model_t *model) {
   input_t *input;
   MA(input, sizeof(input_t), input_t);
 
-  fprintf(stderr,"Loading genetic map for chromosome %s ...  ", rfmix_opts.chromosome);
-  input->genetic_map = new GeneticMap();
-  input->genetic_map->load_map(rfmix_opts.genetic_fname, rfmix_opts.chromosome);
-  fprintf(stderr,"done\n");
+  input->genetic_map = NULL;
+  if (model == NULL) {
+    fprintf(stderr,"Loading genetic map for chromosome %s ...  ", rfmix_opts.chromosome);
+    input->genetic_map = new GeneticMap();
+    input->genetic_map->load_map(rfmix_opts.genetic_fname, rfmix_opts.chromosome);
+    fprintf(stderr,"done\n");
+  }
 
     /* Find and map out all the samples that we will be loading */
   fprintf(stderr,"Mapping samples ... ");
   load_samples(input);
   fprintf(stderr,"%d samples combined\n", input->n_samples);
 
-  fprintf(stderr,"Scanning input VCFs for common SNPs on chromosome %s ...   ", rfmix_opts.chromosome);
-  identify_common_snps(input);
-  fprintf(stderr,"%d SNPs\n", input->n_snps);
+  if (model == NULL) {
+    fprintf(stderr,"Scanning input VCFs for common SNPs on chromosome %s ...   ", rfmix_opts.chromosome);
+    identify_common_snps(input);
+    fprintf(stderr,"%d SNPs\n", input->n_snps);
+  } else {
+    load_model_input(model, input);
+  }
   
   /* Now we know all the samples that we will be loading, and all the SNPs,
-     allocate the space to store the haplotypes */
+     allocate the space to store the haplotypes. Alleles not loaded are missing. */
   for(int i=0; i < input->n_samples; i++) {
     MA(input->samples[i].haplotype[0], sizeof(int8_t)*input->n_snps, int8_t);
     MA(input->samples[i].haplotype[1], sizeof(int8_t)*input->n_snps, int8_t);
+    memset(input->samples[i].haplotype[0], 2, sizeof(int8_t)*input->n_snps);
+    memset(input->samples[i].haplotype[1], 2, sizeof(int8_t)*input->n_snps);
   }
 
   fprintf(stderr,"Loading haplotypes... ");
@@ -768,15 +860,9 @@ void free_input(input_t *input) {
 
     for(int h = 0; h < 2; h++) {
       free(sample->haplotype[h]);
-      free(sample->current_p[h]);
       if (sample->ksp[h]) free(sample->ksp[h]);
-      if (sample->sis_p[h]) free(sample->sis_p[h]);
     }
-
-    for(int h=0; h < 4; h++) {
-       free(sample->est_p[h]);
-       free(sample->msp[h]);
-    }   
+    free_sample_estimates(sample);
 
     int *tmp = (int *) input->sample_hash->lookup(sample->sample_id);
     free(tmp);
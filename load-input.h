@@ -13,8 +13,12 @@
 #ifndef LOAD_INPUT_H
 #define LOAD_INPUT_H
 
-input_t *load_input(void);
+typedef struct rf_model rf_model_t;
+
+input_t *load_input(rf_model_t *model);
 void free_input(input_t *input);
+void init_sample_estimates(input_t *input);
+void free_sample_estimates(sample_t *sample);
 
 #endif
 
@@ -12,6 +12,7 @@
 
 #include "md5rng.h"
 #include <stdint.h>
+#include <string.h>
 
 inline uint32_t F(uint32_t X, uint32_t Y, uint32_t Z) {
   return (X & Y) | ((~X) & Z);
@@ -93,21 +94,140 @@ uint32_t md5(uint32_t k1, uint32_t k2, uint32_t k3, uint32_t k4) {
   return a ^ b ^ c ^ d;
 }
 
-md5rng::md5rng(uint32_t key) {
+/* The same compression eight counters at a time, lane i hashing (k1, k2, k3, k4 + i),
+   using GCC vector extensions. The kernel is compiled twice, once for processors with
+   AVX2, and the md5rng constructor picks which one to use */
+typedef uint32_t v8su __attribute__ ((vector_size (32)));
+
+#define VROT32(x,s) (((x) << (s)) | ((x) >> (32 - (s))))
+#define VFF(a,b,c,d,M,s,t) a = b + VROT32(a + ((b & c) | (~b & d)) + M + t, s)
+#define VGG(a,b,c,d,M,s,t) a = b + VROT32(a + ((b & d) | (c & ~d)) + M + t, s)
+#define VHH(a,b,c,d,M,s,t) a = b + VROT32(a + (b ^ c ^ d) + M + t, s)
+#define VII(a,b,c,d,M,s,t) a = b + VROT32(a + (c ^ (b | ~d)) + M + t, s)
+
+static inline __attribute__((always_inline)) void md5_batch_kernel(uint32_t k1, uint32_t k2, uint32_t k3,
+								   uint32_t k4, int n, uint32_t *out) {
+  const v8su lane = { 0, 1, 2, 3, 4, 5, 6, 7 };
+  const v8su zero = { 0 };
+  
+  for(int i=0; i < n; i += MD5RNG_LANES) {
+    v8su a, b, c, d, m4;
+    uint32_t tmp[MD5RNG_LANES];
+
+    a = zero + 0x01234567;
+    b = zero + 0x89ABCDEF;
+    c = zero + 0xFEDCBA98;
+    d = zero + 0x76543210;
+    m4 = lane + (k4 + (uint32_t) i);
+
+    VFF(a, b, c, d, k1, 7, 0xD76AA478);
+    VFF(d, a, b, c, k2, 12, 0xE8C7B756);
+    VFF(c, d, a, b, k3, 17, 0x242070DB);
+    VFF(b, c, d, a, m4, 22, 0xC1BDCEEE);
+
+    VGG(a, b, c, d, k1, 5,  0xF61E2562);
+    VGG(d, a, b, c, k2, 9,  0xC040B340);
+    VGG(c, d, a, b, k3, 14, 0x265E5A51);
+    VGG(b, c, d, a, m4, 20, 0xE9B6C7AA);
+  
+    VHH(a, b, c, d, k1, 4,  0xFFFA3942);
+    VHH(d, a, b, c, k2, 11, 0x8771F681);
+    VHH(c, d, a, b, k3, 16, 0x6D9D6122);
+    VHH(b, c, d, a, m4, 23, 0xFDE5380C);
+
+    VII(a, b, c, d, k1, 6,  0xF4292244);
+    VII(d, a, b, c, k2, 10, 0x432AFF97);
+    VII(c, d, a, b, k3, 15, 0xAB9423A7);
+    VII(b, c, d, a, m4, 21, 0xFC93A039);
+
+    v8su r = a ^ b ^ c ^ d;
+    if (n - i >= MD5RNG_LANES) {
+      memcpy(out + i, &r, sizeof(r));
+    } else {
+      memcpy(tmp, &r, sizeof(r));
+      memcpy(out + i, tmp, sizeof(uint32_t)*(n - i));
+    }
+  }
+}
+
+static void __attribute__((target("avx2"))) md5_batch_avx2(uint32_t k1, uint32_t k2, uint32_t k3,
+							  uint32_t k4, int n, uint32_t *out) {
+  md5_batch_kernel(k1, k2, k3, k4, n, out);
+}
+
+static void md5_batch_generic(uint32_t k1, uint32_t k2, uint32_t k3, uint32_t k4, int n, uint32_t *out) {
+  md5_batch_kernel(k1, k2, k3, k4, n, out);
+}
+
+#define SPLITMIX_GAMMA 0x9E3779B97F4A7C15ULL
+
+static inline uint64_t splitmix_mix(uint64_t z) {
+  z = (z ^ (z >> 30))*0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27))*0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+static inline uint64_t splitmix_seed(uint32_t k1, uint32_t k2, uint32_t k3) {
+  return splitmix_mix(splitmix_mix(((uint64_t) k1 << 32) | k2) + k3);
+}
+
+static inline uint32_t splitmix_draw(uint64_t seed, uint32_t k4) {
+  return splitmix_mix(seed + ((uint64_t) k4 + 1)*SPLITMIX_GAMMA) >> 32;
+}
+
+static void splitmix_batch(uint32_t k1, uint32_t k2, uint32_t k3, uint32_t k4, int n, uint32_t *out) {
+  uint64_t seed = splitmix_seed(k1, k2, k3);
+
+  for(int i=0; i < n; i++)
+    out[i] = splitmix_draw(seed, k4 + i);
+}
+
+md5rng::md5rng(uint32_t key, int engine) {
   this->key = key;
+  this->engine = engine;
+  if (engine == MD5RNG_SPLITMIX)
+    batch = splitmix_batch;
+  else
+    batch = __builtin_cpu_supports("avx2") ? md5_batch_avx2 : md5_batch_generic;
 }
 
 md5rng::~md5rng() {
 }
 
 uint32_t md5rng::uint32(uint32_t k2, uint32_t k3, uint32_t k4) {
+  if (engine == MD5RNG_SPLITMIX)
+    return splitmix_draw(splitmix_seed(key, k2, k3), k4);
   return md5(key, k2, k3, k4);
 }
 
+/* out[i] = uint32(k2, k3, k4 + i) for i < n, bit for bit, with either engine */
+void md5rng::uint32s(uint32_t k2, uint32_t k3, uint32_t k4, int n, uint32_t *out) {
+  batch(key, k2, k3, k4, n, out);
+}
+
 int md5rng::uniform_int(uint32_t k2, uint32_t k3, uint32_t k4, int l, int r) {
-  double tmp = md5(key, k2, k3, k4)/(double) 0x100000000L;
+  return uniform(uint32(k2, k3, k4), l, r);
+}
+
+md5rng_stream::md5rng_stream(md5rng *rng, uint32_t k2, uint32_t k3, uint32_t k4, int n) {
+  this->rng = rng;
+  this->k2 = k2;
+  this->k3 = k3;
+  this->k4 = k4;
+  this->n = n;
+  n_buf = 0;
+  pos = 0;
+}
 
-  return l + (int) ((r - l)*tmp);
+/* Draws the next batch, the counters still expected if known, but at least one 
+   vector's worth */
+void md5rng_stream::refill() {
+  k4 += n_buf;
+  n -= n_buf;
+  n_buf = MD5RNG_BATCH;
+  if (n < n_buf) n_buf = n < MD5RNG_LANES ? MD5RNG_LANES : n;
+  rng->uint32s(k2, k3, k4, n_buf, buf);
+  pos = 0;
 }
 
 #ifdef MAIN
@@ -14,15 +14,52 @@
 #define MD5RNG_H
 #include <stdint.h>
 
+#define MD5RNG_LANES (8)
+#define MD5RNG_BATCH (64)
+
+/* Engines for the keyed numbers. MD5RNG_MD5 hashes the key with one MD5 block, and
+   MD5RNG_SPLITMIX is a SplitMix64 stream seeded from (seed, k2, k3) at counter k4,
+   much less costly but giving different numbers */
+enum { MD5RNG_MD5=0, MD5RNG_SPLITMIX, N_MD5RNG_ENGINES };
+
 class md5rng {
  public:
-  md5rng(uint32_t seed);
+  md5rng(uint32_t seed, int engine = MD5RNG_MD5);
   ~md5rng();
   uint32_t uint32(uint32_t k2, uint32_t k3, uint32_t k4);
+  void uint32s(uint32_t k2, uint32_t k3, uint32_t k4, int n, uint32_t *out);
   int uniform_int(uint32_t k2, uint32_t k3, uint32_t k4, int l, int r);
+  static inline int uniform(uint32_t x, int l, int r) {
+    double tmp = x/(double) 0x100000000L;
+    
+    return l + (int) ((r - l)*tmp);
+  }
   
  private:
   uint32_t key;
+  int engine;
+  void (*batch)(uint32_t k1, uint32_t k2, uint32_t k3, uint32_t k4, int n, uint32_t *out);
+};
+
+/* Sequential draws uniform_int(k2, k3, k4++, l, r) from rng, made MD5RNG_BATCH counters
+   at a time with uint32s(). n is the number of draws expected, to avoid making many
+   more than are used; more than n may still be drawn */
+class md5rng_stream {
+ public:
+  md5rng_stream(md5rng *rng, uint32_t k2, uint32_t k3, uint32_t k4, int n);
+  inline int uniform_int(int l, int r) {
+    if (pos == n_buf) refill();
+    return md5rng::uniform(buf[pos++], l, r);
+  }
+  /* The counter of the next draw */
+  inline uint32_t next() { return k4 + pos; }
+  
+ private:
+  void refill();
+  md5rng *rng;
+  uint32_t k2, k3, k4;
+  int n, n_buf, pos;
+  uint32_t buf[MD5RNG_BATCH];
 };
 
 #endif
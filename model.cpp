@@ -0,0 +1,423 @@
+/* RFMIX v2.XX - Local Ancestry and Admixture Analysis
+   Bustamante Lab - Stanford School of Medicine
+   (c) 2016 Mark Hamilton Wright
+
+   This program is licensed for academic research use only
+   unless otherwise stated. Contact cdbadmin@stanford.edu for
+   commercial licensing options.
+
+   Academic and research users should cite Brian Maples'
+   paper describing RFMIX in any publication using RFMIX
+   results. Citation is printed when the program is started. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "kmacros.h"
+#include "rfmix.h"
+#include "random-forest.h"
+#include "model.h"
+
+extern rfmix_opts_t rfmix_opts;
+
+#define ALIGN8(x) ( ((x) + 7) & ~((uint64_t) 7) )
+
+rf_model_t *new_model(int n_windows, int n_trees, int n_subpops) {
+  rf_model_t *model;
+  
+  MA(model, sizeof(rf_model_t), rf_model_t);
+  model->n_subpops = n_subpops;
+  model->n_windows = n_windows;
+  model->n_trees = n_trees;
+  model->crf_weight = -1.0;
+  model->header = NULL;
+  model->map_size = 0;
+  model->mapped_forests = NULL;
+  
+  MA(model->forests, sizeof(forest_t *)*n_windows, forest_t *);
+  for(int w=0; w < n_windows; w++) model->forests[w] = NULL;
+
+  return model;
+}
+
+/* Keeps a copy of the forest of window w, which is allocated from memory that will 
+   be recycled. Each window is saved by only one thread, so no locking is needed */
+void save_model_forest(rf_model_t *model, int w, forest_t *forest) {
+  forest_t *copy;
+  size_t leaf_size = forest->leaf_q != NULL ? sizeof(uint16_t) : sizeof(double);
+  size_t size = sizeof(forest_t) + ALIGN8(leaf_size*forest->n_leaf_p) + sizeof(int)*forest->n_trees +
+    sizeof(forest_node_t)*forest->n_nodes + sizeof(int)*forest->n_leaf;
+  char *p;
+
+  /* The leaf values come first, to be aligned for doubles */
+  MA(p, size, char);
+  copy = (forest_t *) p;
+  *copy = *forest;
+  copy->root = (int *) (p + sizeof(forest_t) + ALIGN8(leaf_size*forest->n_leaf_p));
+  copy->nodes = (forest_node_t *) (copy->root + forest->n_trees);
+  copy->leaf_k = (int *) (copy->nodes + forest->n_nodes);
+  if (forest->leaf_q != NULL) {
+    copy->leaf_q = (uint16_t *) (p + sizeof(forest_t));
+    memcpy(copy->leaf_q, forest->leaf_q, sizeof(uint16_t)*forest->n_leaf_p);
+  } else {
+    copy->leaf_p = (double *) (p + sizeof(forest_t));
+    memcpy(copy->leaf_p, forest->leaf_p, sizeof(double)*forest->n_leaf_p);
+  }
+  memcpy(copy->root, forest->root, sizeof(int)*forest->n_trees);
+  memcpy(copy->nodes, forest->nodes, sizeof(forest_node_t)*forest->n_nodes);
+  memcpy(copy->leaf_k, forest->leaf_k, sizeof(int)*forest->n_leaf);
+  
+  model->forests[w] = copy;
+}
+
+/* Pads a section of size bytes with zeros to a multiple of 8 bytes */
+static void write_padding(FILE *f, uint64_t size) {
+  static const char zeros[8] = { 0 };
+
+  FWRITE(zeros, 1, ALIGN8(size) - size, f);
+}
+
+void write_model(rf_model_t *model, input_t *input, char *fname) {
+  int n_windows = model->n_windows;
+  int n_subpops = model->n_subpops;
+  model_header_t header;
+  model_snp_t *snps;
+  model_window_t *windows;
+  model_forest_t *forests;
+  int32_t *roots;
+
+  memset(&header, 0, sizeof(model_header_t));
+  memcpy(header.magic, RFMIX_MODEL_MAGIC, 8);
+  header.version = RFMIX_MODEL_VERSION;
+  header.byte_order = RFMIX_MODEL_BYTE_ORDER;
+  header.header_size = sizeof(model_header_t);
+  header.n_subpops = n_subpops;
+  header.n_snps = input->n_snps;
+  header.n_windows = n_windows;
+  header.n_trees = model->n_trees;
+  header.quantized_leaves = model->forests[0]->leaf_q != NULL;
+  header.crf_weight = model->crf_weight;
+  size_t leaf_size = header.quantized_leaves ? sizeof(uint16_t) : sizeof(double);
+
+  MA(snps, sizeof(model_snp_t)*input->n_snps, model_snp_t);
+  for(int i=0; i < input->n_snps; i++) {
+    snps[i].pos = input->snps[i].pos;
+    snps[i].genetic_pos = input->snps[i].genetic_pos;
+  }
+
+  MA(windows, sizeof(model_window_t)*n_windows, model_window_t);
+  MA(forests, sizeof(model_forest_t)*n_windows, model_forest_t);
+  MA(roots, sizeof(int32_t)*n_windows*model->n_trees, int32_t);
+  uint64_t n_nodes = 0;
+  uint64_t n_leaf = 0;
+  uint64_t n_leaf_p = 0;
+  for(int w=0; w < n_windows; w++) {
+    crf_window_t *crf = input->crf_windows + w;
+    forest_t *forest = model->forests[w];
+    
+    windows[w].snp_idx = crf->snp_idx;
+    windows[w].rf_start_idx = crf->rf_start_idx;
+    windows[w].rf_end_idx = crf->rf_end_idx;
+    windows[w].reserved = 0;
+    windows[w].genetic_pos = crf->genetic_pos;
+
+    forests[w].node_start = n_nodes;
+    forests[w].leaf_start = n_leaf;
+    forests[w].leaf_p_start = n_leaf_p;
+    forests[w].n_nodes = forest->n_nodes;
+    forests[w].n_terminal = forest->n_terminal;
+    forests[w].n_leaf = forest->n_leaf;
+    forests[w].n_leaf_p = forest->n_leaf_p;
+    forests[w].leaf_scale = forest->leaf_scale;
+    for(int t=0; t < model->n_trees; t++)
+      roots[w*model->n_trees + t] = forest->root[t];
+    n_nodes += forest->n_nodes;
+    n_leaf += forest->n_leaf;
+    n_leaf_p += forest->n_leaf_p;
+  }
+
+  uint64_t subpops_size = 0;
+  for(int k=0; k < n_subpops; k++) subpops_size += strlen(input->reference_subpops[k]) + 1;
+  
+  header.chromosome_offset = ALIGN8(sizeof(model_header_t));
+  header.subpops_offset = header.chromosome_offset + ALIGN8(strlen(rfmix_opts.chromosome) + 1);
+  header.snps_offset = header.subpops_offset + ALIGN8(subpops_size);
+  header.windows_offset = header.snps_offset + ALIGN8(sizeof(model_snp_t)*input->n_snps);
+  header.forests_offset = header.windows_offset + ALIGN8(sizeof(model_window_t)*n_windows);
+  header.roots_offset = header.forests_offset + ALIGN8(sizeof(model_forest_t)*n_windows);
+  header.nodes_offset = header.roots_offset + ALIGN8(sizeof(int32_t)*n_windows*model->n_trees);
+  header.leaf_k_offset = header.nodes_offset + ALIGN8(sizeof(forest_node_t)*n_nodes);
+  header.leaf_p_offset = header.leaf_k_offset + ALIGN8(sizeof(int32_t)*n_leaf);
+  header.file_size = header.leaf_p_offset + leaf_size*n_leaf_p;
+  
+  FILE *f = fopen(fname, "w");
+  if (f == NULL) {
+    fprintf(stderr,"Can't open model file %s for writing (%s)\n", fname, strerror(errno));
+    exit(-1);
+  }
+
+  FWRITE(&header, sizeof(model_header_t), 1, f);
+  write_padding(f, sizeof(model_header_t));
+  FWRITE(rfmix_opts.chromosome, 1, strlen(rfmix_opts.chromosome) + 1, f);
+  write_padding(f, strlen(rfmix_opts.chromosome) + 1);
+  for(int k=0; k < n_subpops; k++)
+    FWRITE(input->reference_subpops[k], 1, strlen(input->reference_subpops[k]) + 1, f);
+  write_padding(f, subpops_size);
+  FWRITE(snps, 1, sizeof(model_snp_t)*input->n_snps, f);
+  write_padding(f, sizeof(model_snp_t)*input->n_snps);
+  FWRITE(windows, 1, sizeof(model_window_t)*n_windows, f);
+  write_padding(f, sizeof(model_window_t)*n_windows);
+  FWRITE(forests, 1, sizeof(model_forest_t)*n_windows, f);
+  write_padding(f, sizeof(model_forest_t)*n_windows);
+  FWRITE(roots, 1, sizeof(int32_t)*n_windows*model->n_trees, f);
+  write_padding(f, sizeof(int32_t)*n_windows*model->n_trees);
+  for(int w=0; w < n_windows; w++)
+    FWRITE(model->forests[w]->nodes, 1, sizeof(forest_node_t)*model->forests[w]->n_nodes, f);
+  write_padding(f, sizeof(forest_node_t)*n_nodes);
+  for(int w=0; w < n_windows; w++)
+    FWRITE(model->forests[w]->leaf_k, 1, sizeof(int32_t)*model->forests[w]->n_leaf, f);
+  write_padding(f, sizeof(int32_t)*n_leaf);
+  for(int w=0; w < n_windows; w++) {
+    forest_t *forest = model->forests[w];
+    if (header.quantized_leaves) {
+      FWRITE(forest->leaf_q, 1, sizeof(uint16_t)*forest->n_leaf_p, f);
+    } else {
+      FWRITE(forest->leaf_p, 1, sizeof(double)*forest->n_leaf_p, f);
+    }
+  }
+
+  if (fclose(f) != 0) {
+    fprintf(stderr,"Error writing model file %s (%s)\n", fname, strerror(errno));
+    exit(-1);
+  }
+  
+  free(roots);
+  free(forests);
+  free(windows);
+  free(snps);
+}
+
+static void model_error(char *fname, const char *msg) {
+  fprintf(stderr,"Error: %s is not a usable rfmix model file - %s\n", fname, msg);
+  exit(-1);
+}
+
+/* Checks that the nodes of the tree at root, in forest's arrays as in forest_t, are
+   a tree in preorder no deeper than RF_MAX_TREE_LEVEL, splitting on SNPs below 
+   n_snps, with terminal node p vectors within the forest's leaf entries. Returns 0 
+   if not */
+static int check_tree(forest_t *forest, int root, int n_snps) {
+  int n_subpops = forest->n_subpops;
+  int stack[RF_MAX_TREE_LEVEL + 1];
+  int n_stack = 0;
+  int node = root;
+  int next = root;
+
+  for(;;) {
+    if (node != next || node < 0 || node >= forest->n_nodes) return 0;
+    next++;
+
+    forest_node_t *n = forest->nodes + node;
+    if (n->snp_id >= 0) {
+      if (n->snp_id >= n_snps || n_stack > RF_MAX_TREE_LEVEL) return 0;
+      stack[n_stack++] = n->offset;
+      node = node + 1;
+      continue;
+    }
+
+    int v = -1 - n->snp_id;
+    int o = n->offset;
+    if (v >= forest->n_leaf_p) return 0;
+    if (o < 0) {
+      if (-1 - o >= n_subpops || n_subpops > forest->n_leaf_p - v) return 0;
+    } else {
+      if (o >= forest->n_leaf) return 0;
+      int n_k = forest->leaf_k[o];
+      if (n_k < 0 || n_k >= n_subpops || n_k >= forest->n_leaf - o ||
+	  n_k >= forest->n_leaf_p - v) return 0;
+      for(int j=1; j <= n_k; j++)
+	if (forest->leaf_k[o+j] < 0 || forest->leaf_k[o+j] >= n_subpops) return 0;
+    }
+
+    if (n_stack == 0) return 1;
+    node = stack[--n_stack];
+  }
+}
+
+/* Maps a model file written by write_model() into memory, checks that it is
+   complete and points the forests of its windows into it */
+rf_model_t *read_model(char *fname) {
+  int fd = open(fname, O_RDONLY);
+  struct stat st;
+  
+  if (fd == -1 || fstat(fd, &st) != 0) {
+    fprintf(stderr,"Can't open model file %s (%s)\n", fname, strerror(errno));
+    exit(-1);
+  }
+  if ((size_t) st.st_size < sizeof(model_header_t)) model_error(fname, "file is too short");
+
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) {
+    fprintf(stderr,"Can't map model file %s (%s)\n", fname, strerror(errno));
+    exit(-1);
+  }
+  close(fd);
+
+  char *base = (char *) map;
+  model_header_t *header = (model_header_t *) map;
+  if (memcmp(header->magic, RFMIX_MODEL_MAGIC, 8) != 0) model_error(fname, "bad magic number");
+  if (header->byte_order != RFMIX_MODEL_BYTE_ORDER)
+    model_error(fname, "written on a machine of different byte order");
+  if (header->version != RFMIX_MODEL_VERSION || header->header_size != sizeof(model_header_t)) {
+    fprintf(stderr,"Error: model file %s is version %u, this rfmix reads version %d\n", fname,
+	    header->version, RFMIX_MODEL_VERSION);
+    exit(-1);
+  }
+  if (header->file_size != (uint64_t) st.st_size) model_error(fname, "file is truncated");
+  if (header->n_windows < 1 || header->n_trees < 1 || header->n_subpops < 2 || header->n_snps < 1)
+    model_error(fname, "no forests");
+
+  /* The sections must be in order and within the file */
+  uint64_t offsets[] = { header->chromosome_offset, header->subpops_offset, header->snps_offset,
+			 header->windows_offset, header->forests_offset, header->roots_offset,
+			 header->nodes_offset, header->leaf_k_offset, header->leaf_p_offset,
+			 header->file_size };
+  if (offsets[0] < sizeof(model_header_t)) model_error(fname, "bad section offsets");
+  for(int i=1; i < (int) (sizeof(offsets)/sizeof(uint64_t)); i++)
+    if (offsets[i] < offsets[i-1]) model_error(fname, "bad section offsets");
+  if (header->windows_offset - header->snps_offset < sizeof(model_snp_t)*header->n_snps ||
+      header->forests_offset - header->windows_offset < sizeof(model_window_t)*header->n_windows ||
+      header->roots_offset - header->forests_offset < sizeof(model_forest_t)*header->n_windows ||
+      header->nodes_offset - header->roots_offset < sizeof(int32_t)*header->n_windows*header->n_trees)
+    model_error(fname, "sections too short");
+
+  /* The chromosome and the subpop names must be NUL terminated within their sections */
+  char *name = base + header->chromosome_offset;
+  if (memchr(name, 0, header->subpops_offset - header->chromosome_offset) == NULL)
+    model_error(fname, "bad chromosome name");
+  name = base + header->subpops_offset;
+  for(int k=0; k < header->n_subpops; k++) {
+    char *end = (char *) memchr(name, 0, base + header->snps_offset - name);
+    if (end == NULL) model_error(fname, "bad subpop names");
+    name = end + 1;
+  }
+  
+  rf_model_t *model = new_model(header->n_windows, header->n_trees, header->n_subpops);
+  model->crf_weight = header->crf_weight;
+  model->header = header;
+  model->map_size = st.st_size;
+
+  model_window_t *windows = (model_window_t *) (base + header->windows_offset);
+  for(int w=0; w < header->n_windows; w++) {
+    if (windows[w].rf_start_idx < 0 || windows[w].rf_end_idx >= header->n_snps ||
+	windows[w].rf_start_idx > windows[w].rf_end_idx ||
+	windows[w].snp_idx < 0 || windows[w].snp_idx >= header->n_snps)
+      model_error(fname, "window out of range");
+  }
+
+  model_forest_t *forests = (model_forest_t *) (base + header->forests_offset);
+  int32_t *roots = (int32_t *) (base + header->roots_offset);
+  forest_node_t *nodes = (forest_node_t *) (base + header->nodes_offset);
+  size_t leaf_size = header->quantized_leaves ? sizeof(uint16_t) : sizeof(double);
+  int32_t *leaf_k = (int32_t *) (base + header->leaf_k_offset);
+  uint64_t n_nodes = (header->leaf_k_offset - header->nodes_offset) / sizeof(forest_node_t);
+  uint64_t n_leaf = (header->leaf_p_offset - header->leaf_k_offset) / sizeof(int32_t);
+  uint64_t n_leaf_p = (header->file_size - header->leaf_p_offset) / leaf_size;
+
+  MA(model->mapped_forests, sizeof(forest_t)*model->n_windows, forest_t);
+  for(int w=0; w < model->n_windows; w++) {
+    forest_t *forest = model->mapped_forests + w;
+    
+    if (forests[w].n_nodes < 1 || forests[w].n_leaf < 0 || forests[w].n_leaf_p < 1 ||
+	forests[w].node_start > n_nodes ||
+	(uint64_t) forests[w].n_nodes > n_nodes - forests[w].node_start ||
+	forests[w].leaf_start > n_leaf ||
+	(uint64_t) forests[w].n_leaf > n_leaf - forests[w].leaf_start ||
+	forests[w].leaf_p_start > n_leaf_p ||
+	(uint64_t) forests[w].n_leaf_p > n_leaf_p - forests[w].leaf_p_start)
+      model_error(fname, "forest out of range");
+    
+    forest->n_trees = model->n_trees;
+    forest->n_subpops = model->n_subpops;
+    forest->n_nodes = forests[w].n_nodes;
+    forest->n_terminal = forests[w].n_terminal;
+    forest->n_leaf = forests[w].n_leaf;
+    forest->n_leaf_p = forests[w].n_leaf_p;
+    forest->root = roots + (uint64_t) w*model->n_trees;
+    forest->nodes = nodes + forests[w].node_start;
+    forest->leaf_k = leaf_k + forests[w].leaf_start;
+    forest->leaf_p = NULL;
+    forest->leaf_q = NULL;
+    forest->leaf_scale = 0.;
+    if (header->quantized_leaves) {
+      forest->leaf_q = (uint16_t *) (base + header->leaf_p_offset) + forests[w].leaf_p_start;
+      forest->leaf_scale = forests[w].leaf_scale;
+    } else {
+      forest->leaf_p = (double *) (base + header->leaf_p_offset) + forests[w].leaf_p_start;
+    }
+
+    int n_snps = windows[w].rf_end_idx - windows[w].rf_start_idx + 1;
+    for(int t=0; t < forest->n_trees; t++)
+      if (!check_tree(forest, forest->root[t], n_snps)) model_error(fname, "bad tree");
+    model->forests[w] = forest;
+  }
+
+  return model;
+}
+
+/* Sets up the SNPs, windows and subpops of input from a model read by read_model()
+   in place of loading them from the reference panel */
+void load_model_input(rf_model_t *model, input_t *input) {
+  model_header_t *header = model->header;
+  char *base = (char *) header;
+
+  input->n_subpops = header->n_subpops;
+  MA(input->reference_subpops, sizeof(char *)*header->n_subpops, char *);
+  char *name = base + header->subpops_offset;
+  for(int k=0; k < header->n_subpops; k++) {
+    input->reference_subpops[k] = strdup(name);
+    name += strlen(name) + 1;
+  }
+
+  model_snp_t *snps = (model_snp_t *) (base + header->snps_offset);
+  input->n_snps = header->n_snps;
+  MA(input->snps, sizeof(snp_t)*header->n_snps, snp_t);
+  for(int i=0; i < header->n_snps; i++) {
+    input->snps[i].pos = snps[i].pos;
+    input->snps[i].genetic_pos = snps[i].genetic_pos;
+    input->snps[i].crf_index = -1;
+  }
+  
+  model_window_t *windows = (model_window_t *) (base + header->windows_offset);
+  input->n_windows = header->n_windows;
+  MA(input->crf_windows, sizeof(crf_window_t)*header->n_windows, crf_window_t);
+  for(int w=0; w < header->n_windows; w++) {
+    input->crf_windows[w].snp_idx = windows[w].snp_idx;
+    input->crf_windows[w].rf_start_idx = windows[w].rf_start_idx;
+    input->crf_windows[w].rf_end_idx = windows[w].rf_end_idx;
+    input->crf_windows[w].genetic_pos = windows[w].genetic_pos;
+  }
+}
+
+/* The chromosome a model read by read_model() was trained on */
+char *model_chromosome(rf_model_t *model) {
+  return (char *) model->header + model->header->chromosome_offset;
+}
+
+void free_model(rf_model_t *model) {
+  if (model->header != NULL) {
+    free(model->mapped_forests);
+    munmap(model->header, model->map_size);
+  } else {
+    for(int w=0; w < model->n_windows; w++) free(model->forests[w]);
+  }
+  free(model->forests);
+  free(model);
+}
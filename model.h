@@ -0,0 +1,119 @@
+/* RFMIX v2.XX - Local Ancestry and Admixture Analysis
+   Bustamante Lab - Stanford School of Medicine
+   (c) 2016 Mark Hamilton Wright
+
+   This program is licensed for academic research use only
+   unless otherwise stated. Contact cdbadmin@stanford.edu for
+   commercial licensing options.
+
+   Academic and research users should cite Brian Maples'
+   paper describing RFMIX in any publication using RFMIX
+   results. Citation is printed when the program is started. */
+
+#ifndef MODEL_H
+#define MODEL_H
+
+#include <stdint.h>
+#include "rfmix.h"
+#include "random-forest.h"
+
+/* A model file holds the random forests trained on a reference panel for every
+   window of a chromosome, with the SNPs and windows they were trained on and the
+   reference subpop names, so that query samples can be analyzed later by rfmix apply
+   without the reference panel. 
+
+   The file is a model_header_t followed by the sections it gives the offsets of, 
+   each aligned to 8 bytes, and is used in place by mmap(). Numbers are in the byte
+   order of the machine that wrote the file, which byte_order records.
+
+      chromosome   NUL terminated string
+      subpops      n_subpops NUL terminated strings, in subpop index order
+      snps         model_snp_t[n_snps]
+      windows      model_window_t[n_windows]
+      forests      model_forest_t[n_windows]
+      roots        int32_t[n_windows*n_trees], root node of each tree of each window
+      nodes        forest_node_t[], the nodes of all windows' forests
+      leaf_k       int32_t[], the terminal node leaf entries of all windows' forests
+      leaf_p       the leaf values, double[] or, with quantized_leaves, uint16_t[]
+
+   Root and node offsets are relative to the window's first node and first leaf 
+   entry, and the terminal nodes' value offsets to its first leaf value, given by 
+   its model_forest_t, as in forest_t. Increment RFMIX_MODEL_VERSION
+   with any change to this layout. */
+#define RFMIX_MODEL_MAGIC "RFMIXMDL"
+#define RFMIX_MODEL_VERSION (3)
+#define RFMIX_MODEL_BYTE_ORDER (0x01020304)
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t header_size;
+  int32_t n_subpops;
+  int32_t n_snps;
+  int32_t n_windows;
+  int32_t n_trees;
+  int32_t quantized_leaves;
+  double crf_weight;
+
+  uint64_t chromosome_offset;
+  uint64_t subpops_offset;
+  uint64_t snps_offset;
+  uint64_t windows_offset;
+  uint64_t forests_offset;
+  uint64_t roots_offset;
+  uint64_t nodes_offset;
+  uint64_t leaf_k_offset;
+  uint64_t leaf_p_offset;
+  uint64_t file_size;
+} model_header_t;
+
+typedef struct {
+  int32_t pos;
+  float genetic_pos; // cM
+} model_snp_t;
+
+typedef struct {
+  int32_t snp_idx;
+  int32_t rf_start_idx;
+  int32_t rf_end_idx;
+  int32_t reserved;
+  double genetic_pos; // M, as in crf_window_t
+} model_window_t;
+
+typedef struct {
+  uint64_t node_start;
+  uint64_t leaf_start;
+  uint64_t leaf_p_start;
+  int32_t n_nodes;
+  int32_t n_terminal;
+  int32_t n_leaf;
+  int32_t n_leaf_p;
+  double leaf_scale;
+} model_forest_t;
+
+/* A model in memory. forests[w] is the forest of window w, either kept from 
+   random_forest() to be written by write_model(), or pointing into the mapped file
+   of a model read by read_model() */
+struct rf_model {
+  int n_subpops;
+  int n_windows;
+  int n_trees;
+  double crf_weight;
+  forest_t **forests;
+
+  /* For a model read from a file, the mapped file and forests[] pointing into it */
+  model_header_t *header; // NULL unless read from a file
+  size_t map_size;
+  forest_t *mapped_forests;
+};
+
+rf_model_t *new_model(int n_windows, int n_trees, int n_subpops);
+void save_model_forest(rf_model_t *model, int w, forest_t *forest);
+void write_model(rf_model_t *model, input_t *input, char *fname);
+rf_model_t *read_model(char *fname);
+void load_model_input(rf_model_t *model, input_t *input);
+char *model_chromosome(rf_model_t *model);
+void free_model(rf_model_t *model);
+
+#endif
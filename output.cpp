@@ -20,9 +20,19 @@
 
 #include "kmacros.h"
 #include "rfmix.h"
+#include "md5rng.h"
 
 extern rfmix_opts_t rfmix_opts;
 
+/* Results depend on the random number engine and the classifier, so ones other than
+   the default md5 and random forest are noted in header lines of the output files */
+static void engine_header(FILE *f) {
+  if (rfmix_opts.rng_engine != MD5RNG_MD5)
+    fprintf(f,"#random number engine: %s\n", rfmix_opts.rng_str);
+  if (rfmix_opts.classifier != RF_CLASSIFIER_FOREST)
+    fprintf(f,"#classifier: %s\n", rfmix_opts.classifier_str);
+}
+
 static void msp_output_leader(FILE *f, snp_t *snps, int n_snps, crf_window_t *crfw, int n_windows,
 			      int start, int end) {
   int start_snp, end_snp, n;
@@ -90,6 +100,7 @@ void msp_output(input_t *input) {
     fprintf(f,"\t%s=%d", input->reference_subpops[i], i);
   }
   fprintf(f,"\n");
+  engine_header(f);
   fprintf(f,"#chm\tspos\tepos\tsgpos\tegpos\tn snps");
   for(int j=0; j < input->n_samples; j++) {
     sample_t *sample = input->samples + j;
@@ -174,6 +185,7 @@ reference panel populations, the columns would be:
     fprintf(f,"\t%s", input->reference_subpops[i]);
   }
   fprintf(f,"\n");
+  engine_header(f);
   fprintf(f,"chromosome\tphysical_position\tgenetic_position\tgenetic_marker_index");
   for(int j=0; j < input->n_samples; j++) {
     sample_t *sample = input->samples + j;
@@ -216,6 +228,7 @@ void fb_stay_in_state_output(input_t *input) {
     fprintf(stderr,"Can't open output file %s (%s)\n", fname, strerror(errno));
     exit(-1);
   }
+  engine_header(f);
   fprintf(f,"#chm\tpos\tgpos\tsnp idx");
   for(int j=0; j < input->n_samples; j++)
     fprintf(f,"\t%s.0\t%s.1", input->samples[j].sample_id, input->samples[j].sample_id);
@@ -232,6 +245,27 @@ void fb_stay_in_state_output(input_t *input) {
   }
 }
 
+/* The number of trees the random forest grew for each CRF window with --rf-tolerance */
+#define RF_TREES_EXTENSION ".trees.tsv"
+void rf_trees_output(input_t *input) {
+  int fname_length = strlen(rfmix_opts.output_basename) + strlen(RF_TREES_EXTENSION) + 1;
+  char fname[fname_length];
+
+  sprintf(fname,"%s%s", rfmix_opts.output_basename, RF_TREES_EXTENSION);
+  FILE *f = fopen(fname, "w");
+  if (f == NULL) {
+    fprintf(stderr,"Can't open output file %s (%s)\n", fname, strerror(errno));
+    exit(-1);
+  }
+  engine_header(f);
+  fprintf(f,"#chm\tpos\tgpos\tsnp idx\ttrees\n");
+  for(int i=0; i < input->n_windows; i++) {
+    fprintf(f,"%s\t%d\t%1.5f\t%d\t%d\n", rfmix_opts.chromosome, input->snps[input->crf_windows[i].snp_idx].pos,
+	    input->crf_windows[i].genetic_pos*100., input->crf_windows[i].snp_idx, input->crf_windows[i].n_trees);
+  }
+  fclose(f);
+}
+
 #define Q_EXTENSION (".rfmix.Q")
 void output_Q(input_t *input) {
   fprintf(stderr,"Outputing diploid global ancestry estimates.... \n");
@@ -246,6 +280,7 @@ void output_Q(input_t *input) {
   }
 
   fprintf(f,"#rfmix diploid global ancestry .Q format output\n");
+  engine_header(f);
   fprintf(f,"#sample");
   for(int i=0; i < input->n_subpops; i++) {
     fprintf(f,"\t%s", input->reference_subpops[i]);
@@ -26,23 +26,19 @@
 #include "md5rng.h"
 #include "rfmix.h"
 #include "mm.h"
+#include "thread-pool.h"
+#include "random-forest.h"
+#include "model.h"
 
 extern rfmix_opts_t rfmix_opts;
 extern int em_iteration;
 
-typedef struct {
-  input_t *input;
-  int next_window;
-  int windows_complete;
-  md5rng *rng;
-  
-  pthread_mutex_t lock;
-} thread_args_t;
-
 typedef struct {
   int sample_idx;
   int *haplotype[4];
-  double *est_p[4];
+  int flip_snp; // haplotypes 2 and 3 switch phase at this SNP of the window
+  int analyzed[4]; // 0 where the haplotype's viterbi path is -1 in the window
+  double *est_p[4]; // n_subpops + 1 each, the last used by evaluate_forest()
   //double *current_p[4];
 } wsample_t;
 
@@ -50,66 +46,272 @@ typedef struct {
   int *haplotype;
   double *current_p;
   int max_idx;
+  int label; // subpop current_p is derived from when window hard_labels is set, otherwise -1
+  int unique; // index of the window's unique haplotype this one is identical to
 } ref_haplotype_t;
 
 typedef struct {
   int idx;
-  int rng_idx;
   int n_snps;
-  snp_t *snps;;
+  snp_t *snps;
 
   int n_query_samples;
   wsample_t *query_samples;
 
+  /* The distinct query haplotypes over the window, of the four haplotypes of each
+     query sample those analyzed in the window and not identical to an earlier one.
+     Their alleles are also held as bits, SNP-major in n_query_words words of 64
+     haplotypes, for the evaluation of 64 haplotypes at a time and growing trees
+     lazily. There are n_query_haplotypes, 64 per word, positions for them, 
+     query_mask[] having the bits of those holding a haplotype and query_haplotypes[]
+     and query_est_p[] being NULL for the rest. A phase flipped haplotype whose 
+     original is also distinct sits 32 bits above it in the same word, with its bit in
+     query_flip_bits[], and only has bits of its own from the flip SNP query_flip_snp
+     on (see query_bits()). The n_query_duplicates others get the results of the 
+     distinct haplotype they are identical to in store_window_results(). See 
+     setup_query_bits() */
+  int n_query_haplotypes;
+  int n_query_words;
+  int **query_haplotypes;
+  double **query_est_p;
+  uint64_t *query_allele_bits;
+  uint64_t *query_missing_bits;
+  uint64_t *query_mask;
+  uint64_t *query_flip_bits;
+  int query_flip_snp;
+  int n_query_duplicates;
+  double **query_duplicate_est_p;
+  int *query_duplicate_of;
+
   int n_ref_haplotypes;
   ref_haplotype_t *ref_haplotypes;
 
+  /* Reference haplotypes with identical alleles over the window (and, with hard
+     labels, the same label) are collapsed to one unique haplotype. Trees are built
+     on the unique haplotypes drawn by the bootstrap, weighted by number of draws.
+     With hard labels, unique haplotypes are numbered in order of label. */
+  int n_unique_haplotypes;
+  int **unique_haplotypes;
+  int *unique_labels;
+
   int n_subpops;
   int *n_ref_haplotypes_by_subpop;
   int **ref_haplotype_list;
-} window_t;
 
-/* In version 2 of RFMIX, an explicit tree structure is built classifying the
-   reference haplotypes only, and then the query haplotypes are evaluated on
-   this tree. This is in contrast to RFMIX version 1 never actually building
-   an explicit tree but having an ephemeral one exist on the recursive call
-   stack which is destroyed as the stack unwinds. This is to allow, ultimately,
-   pre-training of the algorithm and storing the trees in serialized form in
-   a file. In version 2 however I do not have plans to actually implement this,
-   only to allow adaptation to support it in the future. */
-typedef struct node {
-  /* snp_id is the index of the SNP that divides decendents into left or right.
-     0 goes left, 1 goes right. */
-  int snp_id;
-  int level;
-  struct node *left;
-  struct node *right;
-
-  /* This is the sum of the current_p for each remaining reference haplotype.
-     p is never normalized to sum to one, not even at node termination. Thus,
-     if on this tree 10 reference haplotypes support assignment of a query
-     haplotype falling at the terminal node for this tree, it counts 10 times
-     as much as another tree for which only one reference haplotype is 
-     supporting subpop assignment at the terminal node. Note that each query
-     haplotype evaluated on the tree can only fall at exactly one terminal
-     node of the tree */
-  double *p;
-} node_t;
+  /* Before the first EM iteration that uses forward-backward results for the
+     reference, every reference haplotype's current_p is p_label for its label 
+     subpop and p_other for all others. The tree building code then only needs 
+     counts of haplotypes by label, not sums of current_p vectors */
+  int hard_labels;
+  double p_label;
+  double p_other;
+
+  /* Bitset split engine, see tree_t. Allele and missing data bits of the unique
+     haplotypes and segments by label, shared by the trees of the window */
+  int n_split_words;
+  uint64_t *allele_bits;
+  uint64_t *missing_bits;
+  int n_segments;
+  int *seg_first;
+  int *seg_word;
+  int *seg_subpop;
+  uint64_t *seg_mask;
+
+  /* The SNPs trees may split on, see setup_split_snps() */
+  int n_split_snps;
+  int *split_snps;
+} window_t;
 
+/* Memory and scratch space for building trees, one for each thread building trees.
+   Trees built are allocated from ma, which is recycled for each window. */
+typedef struct {
+  mm *ma;
+
+  /* scratch space for grow_tree(), kept by the thread for all its windows and grown
+     as needed. Index buffer of bootstrap entries remaining at nodes and its side
+     buffer for entries with missing data, and the nodes and sparse terminal node 
+     p vectors of the tree being built */
+  int *build_q;
+  int build_q_size;
+  int *build_snp_id;
+  int *build_offset;
+  int build_nodes_size;
+  int *build_m;
+  int build_m_size;
+  int *build_leaf_k;
+  int build_leaf_k_size;
+  double *build_leaf_p;
+  int build_leaf_p_size;
+
+  /* scratch space for each window, see setup_tree_builder(). The SNP queue and query
+     haplotype mask of each node on the work stack of grow_tree(), and node bits and
+     weight bit planes for the bitset split engine */
+  int *build_snp_q;
+  uint64_t *build_query_mask;
+  uint64_t *split_bits;
+} tree_builder_t;
+
+/* Random numbers for a tree are drawn from streams keyed by rng_key, which is 
+   derived from the window and the tree's index in it. Stream 0, bootstrap_key, is
+   for the bootstrap, with rng_idx counting the draws, and stream i for node i of the
+   tree, numbered from 1 for the root with children 2i and 2i+1. Each node's draws, 
+   and each tree's, are thus independent of what else is built, in what order. */
 typedef struct {
   int n_subpops;
   md5rng *rng;
+  uint32_t rng_key;
+  uint32_t bootstrap_key;
   int rng_idx;
   int window_idx;
 
+  /* The bootstrap sample is held as multinomial counts over the window's reference
+     haplotypes in draws[]. The bootstrap entries of the tree are then the window's
+     unique haplotypes (see window_t), with haplotypes[] and label[] shared with the
+     window, and weight[] the number of draws of each, 0 for those not drawn. n_drawn
+     is the number of entries drawn, n_draws the total of weight[], and for soft labels
+     only, current_p[] holds the sum of current_p over the draws of each entry as
+     n_haplotypes consecutive vectors of n_subpops, padded with zeros to n_pad, a
+     multiple of RF_P_VECTOR, for the split kernels (see 
+     soft_sums_kernel()) */
   int n_snps;
+  int *draws;
   int **haplotypes;
   int n_haplotypes;
-  double **current_p;
-
-  node_t *root;
+  int n_drawn;
+  int n_pad;
+  double *current_p;
+  int *label;
+  int *weight;
+  int n_draws;
+
+  int hard_labels;
+  double p_label;
+  double p_other;
+
+  /* Bitset split engine - see setup_split_bits(). Bootstrap entries are numbered
+     0 to n_haplotypes-1 and for each SNP the entries carrying allele 1, or missing
+     data, are bits of n_words 64-bit words. With hard labels, entries are in order 
+     of label so that each subpop is a contiguous range of bits, and the segments
+     seg_*[] give the word, subpop and mask of each piece of those ranges, with 
+     seg_first[w] the first segment in word w. The allele and missing bits and the
+     segments are the window's, shared by all its trees. Entry weights are held as
+     n_planes bit planes in weight_bits[], so that weighted counts are sums of
+     popcounts shifted by plane. n_planes is 0 if all weights are 1. These are only
+     valid while the tree is being built. */
+  int n_words;
+  uint64_t *allele_bits;
+  uint64_t *missing_bits;
+  uint64_t *node_bits;
+  int n_planes;
+  uint64_t *weight_bits;
+  int n_segments;
+  int *seg_first;
+  int *seg_word;
+  int *seg_subpop;
+  uint64_t *seg_mask;
+
+  /* In version 2 of RFMIX, an explicit tree structure is built classifying the
+     reference haplotypes only, and then the query haplotypes are evaluated on
+     this tree. This is in contrast to RFMIX version 1 never actually building
+     an explicit tree but having an ephemeral one exist on the recursive call
+     stack which is destroyed as the stack unwinds. This allows pre-training of
+     the algorithm and storing the trees in serialized form in a model file
+     (see model.h, rfmix train and rfmix apply).
+
+     The nodes are stored in preorder in n_nodes long arrays, so the left child of
+     a node always directly follows it. snp_id[i] is the index of the SNP that 
+     divides the decendents of node i into left or right, 0 goes left, 1 goes right,
+     or -1 - v for a terminal node. offset[i] is then the index of the right child, 
+     or for a terminal node the offset o of its p vector in leaf_k[], its values 
+     being from leaf_p[v]. 
+
+     The p vector of a terminal node is the sum of the current_p for each remaining
+     reference haplotype. p is never normalized to sum to one. Thus, if on this tree
+     10 reference haplotypes support assignment of a query haplotype falling at the
+     terminal node for this tree, it counts 10 times as much as another tree for
+     which only one reference haplotype is supporting subpop assignment at the 
+     terminal node. Note that each query haplotype evaluated on the tree can only
+     fall at exactly one terminal node of the tree 
+
+     p vectors are stored sparsely, as usually only a few subpops reach a terminal 
+     node and the rest share the same small value (from p_other with hard labels). 
+     leaf_p[v] is the minimum of the p vector, for every subpop, and leaf_k[o] the
+     number of subpops above it, subpop leaf_k[o+i] being leaf_p[v+i] above it for
+     i from 1 to leaf_k[o]. Where that is no smaller, as with many soft labels, the
+     p vector is dense instead, o is -1 - m for a subpop m at the minimum, and 
+     subpop k is leaf_p[v+k] above the minimum for every k but m, leaf_p[v+m] being 
+     the minimum itself (see dense_leaf()). There are n_leaf entries of leaf_k and 
+     n_leaf_p of leaf_p in all (see append_leaf()) */
+  int n_nodes;
+  int *snp_id;
+  int *offset;
+  int n_terminal;
+  int n_leaf;
+  int n_leaf_p;
+  int *leaf_k;
+  double *leaf_p;
 } tree_t;
 
+/* Forest groups of windows (see setup_forest_groups()) still to be processed by a
+   thread of random_forest_thread(), windows[head] to windows[tail-1]. The thread 
+   takes groups from the head, and threads which have run out of groups steal them 
+   from the tail */
+typedef struct {
+  int *windows;
+  int head;
+  int tail;
+  pthread_mutex_t lock;
+} window_deque_t;
+
+typedef struct {
+  input_t *input;
+  window_deque_t *deques;
+
+  /* Group g of windows sharing one forest is windows group_start[g] to 
+     group_start[g+1]-1 */
+  int n_groups;
+  int *group_start;
+  int windows_complete; // only updated atomically, see report_progress()
+  md5rng *rng;
+
+  /* With rfmix train, the forests are kept in the model, and with rfmix apply, they
+     are taken from it instead of being built */
+  rf_model_t *model;
+
+  /* Shared by the threads of random_forest_nested_thread(), the window processed,
+     its memory, trees and forest, the next of its tasks, and the number of trees
+     built so far and whether they have converged (see forest_converged()) */
+  window_t *window;
+  mm *window_ma;
+  tree_t **trees;
+  forest_t *forest;
+  int next_task;
+  int n_built;
+  int converged;
+  double *last_p;
+  pthread_barrier_t barrier;
+  
+  pthread_mutex_t lock;
+} thread_args_t;
+
+/* The haplotypes remaining at a node while it is being split. When they are dense
+   enough in the tree's entry numbering (at least one in RF_BITSET_MIN_DENSITY bits
+   of the words they span) membership is also set up in tree->node_bits, and 
+   evaluate_snp() counts with word operations instead of walking ref_q[] */
+#define RF_BITSET_MIN_DENSITY (16)
+typedef struct {
+  int *ref_q;
+  int n_ref;
+  int n_weight; // sum of weight[] over ref_q[], the number of bootstrap draws at the node
+  int *n_by_label; // hard labels only, count of draws at node by label
+
+  int use_bits;
+  int w_start;
+  int w_end;
+  int s_start;
+  int s_end;
+} split_node_t;
+
 static void __attribute__((unused))output_vector(FILE *f, double *p, int n, char delim) {
   fprintf(f,"%1.3f",p[0]);
   for(int i=1; i < n; i++)
@@ -124,31 +326,53 @@ static void normalize_vector(double *p, int n) {
     p[i] /= p_sum;
 }
 
-static void output_node(FILE *f, node_t *node, int n) {
-
-  if (node->snp_id == -1) {
+static void output_node(FILE *f, tree_t *tree, int i) {
+  int n = tree->n_subpops;
+  
+  if (tree->snp_id[i] < 0) {
+    int o = tree->offset[i];
+    double *leaf_p = tree->leaf_p - 1 - tree->snp_id[i];
+    double p[n];
+    if (o < 0) {
+      for(int k=0; k < n; k++)
+	p[k] = leaf_p[-1 - o] + (k != -1 - o ? leaf_p[k] : 0.);
+    } else {
+      for(int k=0; k < n; k++)
+	p[k] = leaf_p[0];
+      for(int j=1; j <= tree->leaf_k[o]; j++)
+	p[tree->leaf_k[o+j]] += leaf_p[j];
+    }
     fprintf(f,"(-1,[");
-    fprintf(f,"%1.1f", node->p[0]);
+    fprintf(f,"%1.1f", p[0]);
     for(int k=1; k < n-1; k++)
-      fprintf(f,",%1.1f", node->p[k]);
+      fprintf(f,",%1.1f", p[k]);
     fprintf(f,"])");
   }
   else {
-    fprintf(f,"(%d,", node->snp_id);
-    output_node(f, node->left, n);
+    fprintf(f,"(%d,", tree->snp_id[i]);
+    output_node(f, tree, i+1);
     fprintf(f,",");
-    output_node(f, node->right, n);
+    output_node(f, tree, tree->offset[i]);
     fprintf(f,")");
   }
 }
 
 static void __attribute__((unused))output_tree(FILE *f, tree_t *tree) {
-  output_node(f, tree->root, tree->n_subpops);
+  output_node(f, tree, 0);
   fprintf(f,"\n\n");
 }
 
-static inline void add_current_p(double *p, double *current_p, int n) {
-  for(int k=0; k < n; k++) p[k] += current_p[k];
+/* The soft label split kernels sum current_p vectors RF_P_VECTOR doubles at a time,
+   with GCC vector extensions. Each lane is a subpop, so the sums are the same as 
+   adding one subpop at a time. v4df_u is for loads of vectors that may not be 
+   aligned. */
+#define RF_P_VECTOR (4)
+typedef double v4df __attribute__((vector_size(32)));
+typedef double v4df_u __attribute__((vector_size(32), aligned(8)));
+
+static inline __attribute__((always_inline)) void add_current_p(v4df *p, double *current_p, int n_vec) {
+  v4df_u *c = (v4df_u *) current_p;
+  for(int v=0; v < n_vec; v++) p[v] += c[v];
 }
 
 /* Normalizes a probability vector and returns the shannon information - any
@@ -191,39 +415,208 @@ static double gini_index(double *p, int n) {
   return 1.0 - gi;
 }
   
-/* calculates the sum of the shannon information content of the resulting child 
-   nodes if we split the reference haplotypes remaining <ref_q> on snp <snp>. This
-   function and its caller can also use the gini index for this purpose */
-static double evaluate_snp(double *si, double *n_child, tree_t *tree, int snp, int *ref_q, int n_ref, mm *ma) {
-  int j,k;
-  double p[2][tree->n_subpops];
+/* Sum of current_p over n haplotypes, n_by_label[k] of which have label k, for
+   hard labels */
+static void labeled_p(double *p, tree_t *tree, int *n_by_label, int n) {
+  for(int k=0; k < tree->n_subpops; k++)
+    p[k] = n_by_label[k]*tree->p_label + (n - n_by_label[k])*tree->p_other;
+}
+
+/* With hard labels, the split is fully described by the number of haplotypes of each
+   label at the node, and the number of those with allele 1 (c1) or missing data (cm)
+   at the SNP. Missing data haplotypes go down both branches, counting half to each. */
+static double counts_split(double *si, double *n_child, tree_t *tree, int *n_by_label,
+			   int *c1, int *cm) {
+  int k;
+  int n_subpops = tree->n_subpops;
+  int c[2][n_subpops];
+  int n[2], n_missing;
+  double p[2][n_subpops];
+
+  n[0] = n[1] = n_missing = 0;
+  for(k=0; k < n_subpops; k++) {
+    c[0][k] = n_by_label[k] - c1[k];
+    c[1][k] = c1[k] + cm[k];
+    n[0] += c[0][k];
+    n[1] += c[1][k];
+    n_missing += cm[k];
+  }
+  labeled_p(p[0], tree, c[0], n[0]);
+  labeled_p(p[1], tree, c[1], n[1]);
+  n_child[0] = n[0] - 0.5*n_missing;
+  n_child[1] = n[1] - 0.5*n_missing;
   
-  for(k=0; k < tree->n_subpops; k++) {
-    p[0][k] = 0.;
-    p[1][k] = 0.;
+  si[0] = gini_index(p[0], n_subpops)*n_child[0];
+  si[1] = gini_index(p[1], n_subpops)*n_child[1];
+
+  return (si[0] + si[1])/(n_child[0] + n_child[1]);
+}
+
+/* Soft labels. Sums current_p of the node haplotypes going to each child into p0[]
+   and p1[], and counts bootstrap draws going to each child in n2[] in halves, as 
+   haplotypes with missing data count half to each child. The sums are 
+   n_pad/RF_P_VECTOR vectors each. The kernel is compiled twice, once for
+   processors with AVX2, and soft_sums is set to the one to use by random_forest() */
+static inline __attribute__((always_inline)) void soft_sums_kernel(v4df *p0, v4df *p1, int *n2, tree_t *tree,
+								  int snp, split_node_t *node) {
+  int n_vec = tree->n_pad / RF_P_VECTOR;
+  int *ref_q = node->ref_q;
+  
+  if (node->use_bits) {
+    /* Alleles are read from the bit words instead of through tree->haplotypes[]. 
+       Haplotypes are visited in increasing entry order, the same order as ref_q[], 
+       so sums are identical */
+    uint64_t *a = tree->allele_bits + (size_t) snp*tree->n_words;
+    uint64_t *m = tree->missing_bits + (size_t) snp*tree->n_words;
+    for(int w=node->w_start; w < node->w_end; w++) {
+      uint64_t x = tree->node_bits[w];
+      while(x) {
+	int b = __builtin_ctzll(x);
+	int e = (w << 6) + b;
+	double *current_p = tree->current_p + e*tree->n_pad;
+	if ((a[w] >> b) & 1) {
+	  add_current_p(p1, current_p, n_vec);
+	  n2[1] += 2*tree->weight[e];
+	} else if ((m[w] >> b) & 1) {
+	  add_current_p(p0, current_p, n_vec);
+	  add_current_p(p1, current_p, n_vec);
+	  n2[0] += tree->weight[e];
+	  n2[1] += tree->weight[e];
+	} else {
+	  add_current_p(p0, current_p, n_vec);
+	  n2[0] += 2*tree->weight[e];
+	}
+	x &= x - 1;
+      }
+    }
+    return;
   }
-  n_child[0] = 0.;
-  n_child[1] = 0.;
   
-  for(j=0; j < n_ref; j++) {
+  for(int j=0; j < node->n_ref; j++) {
+    int w = tree->weight[ref_q[j]];
+    double *current_p = tree->current_p + ref_q[j]*tree->n_pad;
     if (tree->haplotypes[ref_q[j]][snp] == 0) {
-      add_current_p(p[0], tree->current_p[ref_q[j]], tree->n_subpops);
-      n_child[0] += 1.0;
+      add_current_p(p0, current_p, n_vec);
+      n2[0] += 2*w;
     }
     else if (tree->haplotypes[ref_q[j]][snp] == 1) {
-      add_current_p(p[1], tree->current_p[ref_q[j]], tree->n_subpops);
-      n_child[1] += 1.0;
+      add_current_p(p1, current_p, n_vec);
+      n2[1] += 2*w;
     }
     else {
-      /* Missing data code - perhaps we should test explicitly for it? */
       /* We handle missing data by sending the haplotypes having missing data down
 	 to both child nodes */
-      add_current_p(p[0], tree->current_p[ref_q[j]], tree->n_subpops);
-      add_current_p(p[1], tree->current_p[ref_q[j]], tree->n_subpops);
-      n_child[0] += 0.5;
-      n_child[1] += 0.5;
+      add_current_p(p0, current_p, n_vec);
+      add_current_p(p1, current_p, n_vec);
+      n2[0] += w;
+      n2[1] += w;
+    }
+  }
+}
+
+static void __attribute__((target("avx2"))) soft_sums_avx2(v4df *p0, v4df *p1, int *n2, tree_t *tree,
+							  int snp, split_node_t *node) {
+  soft_sums_kernel(p0, p1, n2, tree, snp, node);
+}
+
+static void soft_sums_generic(v4df *p0, v4df *p1, int *n2, tree_t *tree, int snp, split_node_t *node) {
+  soft_sums_kernel(p0, p1, n2, tree, snp, node);
+}
+
+static void (*soft_sums)(v4df *p0, v4df *p1, int *n2, tree_t *tree, int snp, split_node_t *node) = soft_sums_generic;
+
+/* Counts by label of the node haplotypes having allele 1 (c1) or missing data (cm) at
+   snp, a word at a time. The kernel is compiled twice, once for processors with a 
+   popcnt instruction, and count_bits is set to the one to use by random_forest() */
+static inline __attribute__((always_inline)) void count_bits_kernel(int *c1, int *cm, tree_t *tree,
+								   int snp, int s_start, int s_end) {
+  uint64_t *a = tree->allele_bits + (size_t) snp*tree->n_words;
+  uint64_t *m = tree->missing_bits + (size_t) snp*tree->n_words;
+  uint64_t *node = tree->node_bits;
+  
+  if (tree->n_planes == 0) {
+    for(int s=s_start; s < s_end; s++) {
+      int w = tree->seg_word[s];
+      uint64_t x = node[w] & tree->seg_mask[s];
+      c1[tree->seg_subpop[s]] += __builtin_popcountll(x & a[w]);
+      cm[tree->seg_subpop[s]] += __builtin_popcountll(x & m[w]);
+    }
+    return;
+  }
+
+  for(int s=s_start; s < s_end; s++) {
+    int w = tree->seg_word[s];
+    uint64_t x = node[w] & tree->seg_mask[s];
+    uint64_t xa = x & a[w];
+    uint64_t xm = x & m[w];
+    uint64_t *plane = tree->weight_bits + w;
+    for(int b=0; b < tree->n_planes; b++, plane += tree->n_words) {
+      c1[tree->seg_subpop[s]] += __builtin_popcountll(xa & *plane) << b;
+      cm[tree->seg_subpop[s]] += __builtin_popcountll(xm & *plane) << b;
+    }
+  }
+}
+
+static void __attribute__((target("popcnt"))) count_bits_popcnt(int *c1, int *cm, tree_t *tree,
+								  int snp, int s_start, int s_end) {
+  count_bits_kernel(c1, cm, tree, snp, s_start, s_end);
+}
+
+static void count_bits_generic(int *c1, int *cm, tree_t *tree, int snp, int s_start, int s_end) {
+  count_bits_kernel(c1, cm, tree, snp, s_start, s_end);
+}
+
+static void (*count_bits)(int *c1, int *cm, tree_t *tree, int snp, int s_start, int s_end) = count_bits_generic;
+
+/* calculates the sum of the shannon information content of the resulting child 
+   nodes if we split the reference haplotypes remaining at <node> on snp <snp>. This
+   function and its caller can also use the gini index for this purpose */
+static double evaluate_snp(double *si, double *n_child, tree_t *tree, int snp, split_node_t *node) {
+  int j,k;
+  int *ref_q = node->ref_q;
+  int n_ref = node->n_ref;
+
+  if (tree->hard_labels) {
+    int c1[tree->n_subpops], cm[tree->n_subpops];
+    for(k=0; k < tree->n_subpops; k++) {
+      c1[k] = 0;
+      cm[k] = 0;
+    }
+
+    if (node->use_bits) {
+      count_bits(c1, cm, tree, snp, node->s_start, node->s_end);
+    } else {
+      for(j=0; j < n_ref; j++) {
+	int allele = tree->haplotypes[ref_q[j]][snp];
+	if (allele == 1)
+	  c1[tree->label[ref_q[j]]] += tree->weight[ref_q[j]];
+	else if (allele != 0)
+	  cm[tree->label[ref_q[j]]] += tree->weight[ref_q[j]];
+      }
     }
+
+    return counts_split(si, n_child, tree, node->n_by_label, c1, cm);
+  }
+  
+  /* Soft labels, see soft_sums_kernel() */
+  int n_vec = tree->n_pad / RF_P_VECTOR;
+  v4df sums[2][n_vec];
+  double p[2][tree->n_subpops];
+  int n2[2];
+  
+  for(int v=0; v < n_vec; v++) {
+    sums[0][v] = (v4df) { 0., 0., 0., 0. };
+    sums[1][v] = sums[0][v];
+  }
+  n2[0] = 0;
+  n2[1] = 0;
+  soft_sums(sums[0], sums[1], n2, tree, snp, node);
+  for(k=0; k < tree->n_subpops; k++) {
+    p[0][k] = sums[0][k / RF_P_VECTOR][k % RF_P_VECTOR];
+    p[1][k] = sums[1][k / RF_P_VECTOR][k % RF_P_VECTOR];
   }
+  n_child[0] = n2[0]*0.5;
+  n_child[1] = n2[1]*0.5;
 
   si[0] = gini_index(p[0], tree->n_subpops)*n_child[0];
   si[1] = gini_index(p[1], tree->n_subpops)*n_child[1];
@@ -234,43 +627,77 @@ static double evaluate_snp(double *si, double *n_child, tree_t *tree, int snp, i
   return (si[0] + si[1])/(n_child[0] + n_child[1]);
 }
 
-static node_t* add_node(tree_t *tree, int *snp_q, int n_snps, int *ref_q, int n_ref,
-			double si, mm *ma, int level) {
+/* Sets up <node> for evaluate_snp() with the haplotypes ref_q[] remaining. ref_q[] is
+   always in increasing order, so the words spanned are known from the first and last
+   entries. */
+static void setup_split_node(split_node_t *node, tree_t *tree, int *ref_q, int n_ref, int *n_by_label) {
+  node->ref_q = ref_q;
+  node->n_ref = n_ref;
+  node->n_by_label = n_by_label;
+  node->use_bits = 0;
+
+  node->n_weight = 0;
+  for(int i=0; i < n_ref; i++) node->n_weight += tree->weight[ref_q[i]];
+  
+  if (tree->hard_labels) {
+    for(int k=0; k < tree->n_subpops; k++) n_by_label[k] = 0;
+    for(int i=0; i < n_ref; i++) n_by_label[tree->label[ref_q[i]]] += tree->weight[ref_q[i]];
+  }
+  
+  if (tree->n_words == 0 || n_ref < 2) return;
+
+  node->w_start = ref_q[0] >> 6;
+  node->w_end = (ref_q[n_ref-1] >> 6) + 1;
+  if (n_ref*RF_BITSET_MIN_DENSITY < (node->w_end - node->w_start)*64) return;
+
+  memset(tree->node_bits + node->w_start, 0, sizeof(uint64_t)*(node->w_end - node->w_start));
+  for(int i=0; i < n_ref; i++)
+    tree->node_bits[ref_q[i] >> 6] |= (uint64_t) 1 << (ref_q[i] & 0x3F);
+  if (tree->hard_labels) {
+    node->s_start = tree->seg_first[node->w_start];
+    node->s_end = tree->seg_first[node->w_end];
+  }
+  node->use_bits = 1;
+}
 
-  node_t *node = (node_t *) ma->allocate(sizeof(node_t), WHEREFROM);
-  node->p = NULL;
-  node->level = level;
+/* Sum of current_p over all bootstrap draws of the haplotypes remaining at node */
+static void node_p(double *p, tree_t *tree, split_node_t *node) {
+  if (tree->hard_labels) {
+    labeled_p(p, tree, node->n_by_label, node->n_weight);
+    return;
+  }
   
-  /* Terminate recursion if there is only 1 reference haplotype left, no snps left
-     to divide on, or the information content is less than half a bit per haplotype */
-  if (n_snps == 0 || n_ref <= 1 || level >= 20) {
-#ifndef DEBUG_L1
-    assert(n_ref != 0);
-#endif
-    node->p = (double *) ma->allocate(sizeof(double)*tree->n_subpops, WHEREFROM);
+  for(int k=0; k < tree->n_subpops; k++)
+    p[k] = 0.;
+  for(int i=0; i < node->n_ref; i++) {
     for(int k=0; k < tree->n_subpops; k++)
-      node->p[k] = 0.;
-    for(int i=0; i < n_ref; i++) {
-      for(int k=0; k < tree->n_subpops; k++)
-	node->p[k] += tree->current_p[ref_q[i]][k];
-    }
-#ifdef DEBUG_L1
+      p[k] += tree->current_p[node->ref_q[i]*tree->n_pad + k];
+  }
+}
+
+/* Chooses the SNP to divide the haplotypes remaining at a node on. Returns -1 if the
+   node is to be terminal. Otherwise the SNP chosen is moved to the end of the first
+   *n_snps SNPs of snp_q[], *n_snps is set to the number of SNPs the children of the 
+   node can choose from, and best_si[] is the information of the two children. */
+static int choose_split_snp(tree_t *tree, int *snp_q, int *n_snps_p, split_node_t *split_node,
+			    uint32_t node_id, int level, double si, double *best_si) {
+  int n_snps = *n_snps_p;
+  
+  /* Terminate if there is only 1 reference haplotype left, no snps left to divide on,
+     or the information content is less than half a bit per haplotype. Haplotypes are
+     counted by bootstrap draws, not distinct entries */
+  if (n_snps == 0 || split_node->n_weight <= 1 || level >= RF_MAX_TREE_LEVEL) {
+#ifndef DEBUG_L1
+    assert(split_node->n_ref != 0);
+#else
     /* This should not happen as the termination condition below should be triggered
        because of lack of a SNP to choose which still results in at least one haplotype
        in each branch. If we do get here, something is incorrect in the code below */
-    if (n_ref == 0) fprintf(stderr,"N HAPLOTYPES IS ZERO!\n");
+    if (split_node->n_ref == 0) fprintf(stderr,"N HAPLOTYPES IS ZERO!\n");
     fprintf(stderr,"Force terminate tree at level %d - %6.1f  %3d snps  %3d haplotypes\n",
-	    level, si, n_snps, n_ref);
-    fprintf(stderr,"[ %4.1f", node->p[0]);
-    for(int k=1; k < tree->n_subpops; k++)
-      fprintf(stderr,", %4.1f",node->p[k]);
-    fprintf(stderr," ]\n");
+	    level, si, n_snps, split_node->n_ref);
 #endif
-    
-    node->left = NULL;
-    node->right = NULL;
-    node->snp_id = -1;
-    return node;
+    return -1;
   }
 
   /* In original version 1 RFMIX, the number of SNPs which are randomly evaluated from
@@ -282,10 +709,16 @@ static node_t* add_node(tree_t *tree, int *snp_q, int n_snps, int *ref_q, int n_
   //if (n_try < 10) n_try = n_snps;
 
   /* Randomly permute the array of SNPs, then evaluate the first n_try of them. The random
-     number generator is key'd to the window index for repeatability of runs on the same
-     input with multithreading enabled */
-  for(int i=0; i < n_snps; i++) {
-    int j = tree->rng->uniform_int(RFOREST_RNG_KEY, tree->window_idx, tree->rng_idx++, 0, n_snps);
+     number generator is key'd to the window index and node for repeatability of runs on
+     the same input with multithreading enabled. The draws are made in batches, giving 
+     the same numbers as one at a time. With the md5 engine all n_snps are shuffled, as
+     they always have been, otherwise a partial Fisher-Yates shuffle draws each SNP 
+     just before it is evaluated, only as many as are */
+  uint32_t node_key = tree->rng->uint32(tree->rng_key, tree->window_idx, node_id);
+  int partial = rfmix_opts.rng_engine != MD5RNG_MD5;
+  md5rng_stream draws(tree->rng, node_key, tree->window_idx, 0, partial ? n_try : n_snps);
+  for(int i=0; i < n_snps && !partial; i++) {
+    int j = draws.uniform_int(0, n_snps);
     int tmp = snp_q[i];
     snp_q[i] = snp_q[j];
     snp_q[j] = tmp;
@@ -294,13 +727,18 @@ static node_t* add_node(tree_t *tree, int *snp_q, int n_snps, int *ref_q, int n_
   int best_snp = -1;
   double best_split = DBL_MAX;;
   double child_si[2];
-  double best_si[2];
   double child_n[2];
   for(int i=0; i < n_try && i < n_snps; i++) {
+    if (partial) {
+      int j = draws.uniform_int(i, n_snps);
+      int tmp = snp_q[i];
+      snp_q[i] = snp_q[j];
+      snp_q[j] = tmp;
+    }
     int snp = snp_q[i];
 
 #define NODE_SIZE (2.0)
-    double split_information = evaluate_snp(child_si, child_n, tree, snp, ref_q, n_ref, ma);
+    double split_information = evaluate_snp(child_si, child_n, tree, snp, split_node);
     if (split_information < best_split &&
 	child_n[0] > rfmix_opts.node_size && child_n[1] > rfmix_opts.node_size) {
       //#define DEBUG_L2
@@ -313,7 +751,8 @@ static node_t* add_node(tree_t *tree, int *snp_q, int n_snps, int *ref_q, int n_
       best_si[1] = child_si[1];
       best_split = split_information;      
     } else if (child_n[0] <= rfmix_opts.node_size || child_n[1] <= rfmix_opts.node_size ||
-	       (fabs(child_n[0] - n_ref) < 0.1 && fabs(child_n[1] - n_ref) < 0.1)) {
+	       (fabs(child_n[0] - split_node->n_weight) < 0.1 &&
+		fabs(child_n[1] - split_node->n_weight) < 0.1)) {
       snp_q[i] = snp_q[n_snps-1];
       snp_q[n_snps-1] = snp;
       n_snps--;
@@ -325,128 +764,351 @@ static node_t* add_node(tree_t *tree, int *snp_q, int n_snps, int *ref_q, int n_
      that both branches have at least one haplotype, with the n_try SNPs evaluated. This
      terminates the tree at this node. */
   if (best_snp == -1) {
-    node->p = (double *) ma->allocate(sizeof(double)*tree->n_subpops, WHEREFROM);
-    for(int k=0; k < tree->n_subpops; k++)
-      node->p[k] = 0.;
-    for(int i=0; i < n_ref; i++) {
-      for(int k=0; k < tree->n_subpops; k++)
-	node->p[k] += tree->current_p[ref_q[i]][k];
-    }
-
     //#define DEBUG_L2
 #ifdef DEBUG_L2
     fprintf(stderr,"Terminate tree at level %d (%d snps remain)\n", level, n_snps);
-    fprintf(stderr,"[ %4.1f", node->p[0]);
-    for(int k=1; k < tree->n_subpops; k++)
-      fprintf(stderr,", %4.1f",node->p[k]);
-    fprintf(stderr," ]\n");
 #endif
-    //    normalize_vector(node->p, tree->n_subpops);
-    
-    node->left = NULL;
-    node->right = NULL;
-    node->snp_id = -1;
-    return node;
+    return -1;
   }
 
-  /* Normal condition - we divide the haplotypes based on SNP snp_q[best_snp] */
-  node->snp_id = snp_q[best_snp];
+  /* Move the selected SNP to the end of the queue. We'll tell the children the queue
+     is one shorter. */
+  int snp = snp_q[best_snp];
+  snp_q[best_snp] = snp_q[n_snps-1];
+  snp_q[n_snps-1] = snp;
+  *n_snps_p = n_snps - 1;
   
-  int *child_ref_q[2];
-  int child_n_ref[2];
+  return snp;
+}
+
+/* Whether a p vector with n subpops above its minimum, n + 1 sparse entries with 
+   the minimum, is no larger stored densely, its values being value_size bytes each
+   (see tree_t) */
+static inline int dense_leaf(int n, int n_subpops, size_t value_size) {
+  return (n + 1)*(sizeof(int) + value_size) >= n_subpops*value_size;
+}
+
+/* Appends the terminal node p vector p[] to the builder's leaf entries, *n_leaf of 
+   leaf_k and *n_leaf_p of leaf_p so far (see tree_t), returning its offset. Its 
+   values start at the old *n_leaf_p */
+static int append_leaf(tree_builder_t *builder, int *n_leaf, int *n_leaf_p, double *p,
+		       int n_subpops) {
+  if (*n_leaf + n_subpops > builder->build_leaf_k_size) {
+    builder->build_leaf_k_size = builder->build_leaf_k_size*2 + 256 + n_subpops;
+    RA(builder->build_leaf_k, builder->build_leaf_k_size, int);
+  }
+  if (*n_leaf_p + n_subpops > builder->build_leaf_p_size) {
+    builder->build_leaf_p_size = builder->build_leaf_p_size*2 + 256 + n_subpops;
+    RA(builder->build_leaf_p, builder->build_leaf_p_size, double);
+  }
+
+  int m = 0;
+  for(int k=1; k < n_subpops; k++)
+    if (p[k] < p[m]) m = k;
+  double min_p = p[m];
+  int n = 0;
+  for(int k=0; k < n_subpops; k++)
+    if (p[k] != min_p) n++;
+
+  double *leaf_p = builder->build_leaf_p + *n_leaf_p;
+  if (dense_leaf(n, n_subpops, sizeof(double))) {
+    for(int k=0; k < n_subpops; k++)
+      leaf_p[k] = p[k] - min_p;
+    leaf_p[m] = min_p;
+    *n_leaf_p += n_subpops;
+    return -1 - m;
+  }
+
+  int o = *n_leaf;
+  int *leaf_k = builder->build_leaf_k + o;
+  leaf_k[0] = n;
+  leaf_p[0] = min_p;
+  for(int k=0, i=1; k < n_subpops; k++) {
+    if (p[k] == min_p) continue;
+    leaf_k[i] = k;
+    leaf_p[i++] = p[k] - min_p;
+  }
+  *n_leaf += n + 1;
+  *n_leaf_p += n + 1;
+
+  return o;
+}
+
+static void grow_build_q(tree_builder_t *builder, int size) {
+  if (size <= builder->build_q_size) return;
+  while(builder->build_q_size < size) builder->build_q_size = builder->build_q_size*2 + 1024;
+  RA(builder->build_q, builder->build_q_size, int);
+}
+
+/* A node waiting on the work stack of grow_tree(). Its haplotypes are the n_ref
+   bootstrap entries at builder->build_q + base */
+/* Sets *a and *m to the allele and missing data bits of word w of the window's query
+   haplotypes at SNP snp. Before the flip SNP, a phase flipped haplotype attached to
+   its original has the original's alleles, and takes its bits 32 below, so that it
+   goes down the tree with the original until the first node splitting on a SNP at or
+   past the flip SNP, and only from there on its own way (see setup_query_bits()) */
+static inline void query_bits(uint64_t *a, uint64_t *m, window_t *window, int snp, int w) {
+  size_t i = (size_t) snp*window->n_query_words + w;
+
+  *a = window->query_allele_bits[i];
+  *m = window->query_missing_bits[i];
+  if (snp < window->query_flip_snp) {
+    uint64_t flips = window->query_flip_bits[w];
+    *a |= (*a << 32) & flips;
+    *m |= (*m << 32) & flips;
+  }
+}
+
+typedef struct {
+  int parent; // node this is the right child of, or -1 for a left child or the root
+  uint32_t node_id;
+  int base;
+  int n_ref;
+  int n_snps;
+  int level;
+  double si;
+} build_item_t;
+
+/* Builds the nodes of the tree depth first, left before right, from the n_drawn
+   bootstrap entries set up at the start of builder->build_q. The entries of a node are
+   partitioned in place into those of its two children, right child first:
+
+       [ node entries ]  ->  [ right + missing | left + missing ]
+
+   Entries with missing data go to both children, and are held in the side buffer
+   builder->build_m while partitioning. The left child's entries are then at the top
+   of the buffer, free to be partitioned in turn with the space above them, and the
+   right child's are only partitioned once the left subtree is done. The entries of
+   each child are kept in increasing order (see setup_split_node()). 
+
+   The node at slot i of the work stack has its own copy of the SNP queue, of the SNPs
+   left after its parent's split, at builder->build_snp_q + i*window->n_snps. With
+   rfmix_opts.lazy_trees, it also has the mask of query haplotypes reaching it at 
+   builder->build_query_mask + i*window->n_query_words, and a node no query haplotype
+   reaches is left terminal without being split. Since nothing about building a node
+   depends on any but its ancestors, the nodes that are reached come out the same as
+   growing the full tree. The root's SNP queue and mask are set up by the caller. */
+static void grow_tree(tree_t *tree, window_t *window, tree_builder_t *builder, int n_snps, double si) {
+  mm *ma = builder->ma;
+  int n_subpops = tree->n_subpops;
+  int n_query_words = window->n_query_words;
+  int lazy = rfmix_opts.lazy_trees;
+  build_item_t stack[RF_MAX_TREE_LEVEL + 2];
+  int n_stack = 0;
+  int n_nodes = 0;
+  int n_terminal = 0;
+  int n_leaf = 0;
+  int n_leaf_p = 0;
+  double p[n_subpops];
+
+  stack[0].parent = -1;
+  stack[0].node_id = 1;
+  stack[0].base = 0;
+  stack[0].n_ref = tree->n_drawn;
+  stack[0].n_snps = n_snps;
+  stack[0].level = 0;
+  stack[0].si = si;
+  n_stack = 1;
   
-  for(int j=0; j < 2; j++) child_n_ref[j] = 0;
-  for(int i=0; i < n_ref; i++) {
-    if (tree->haplotypes[ref_q[i]][snp_q[best_snp]] == 0) {
-      child_n_ref[0]++;
+  while(n_stack > 0) {
+    build_item_t item = stack[--n_stack];
+    int *ref_q = builder->build_q + item.base;
+    int *snp_q = builder->build_snp_q + n_stack*window->n_snps;
+    uint64_t *query_mask = builder->build_query_mask + n_stack*n_query_words;
+
+    if (n_nodes == builder->build_nodes_size) {
+      builder->build_nodes_size = builder->build_nodes_size*2 + 256;
+      RA(builder->build_snp_id, builder->build_nodes_size, int);
+      RA(builder->build_offset, builder->build_nodes_size, int);
     }
-    else if (tree->haplotypes[ref_q[i]][snp_q[best_snp]] == 1) {
-      child_n_ref[1]++;
+    int node = n_nodes++;
+    if (item.parent != -1) builder->build_offset[item.parent] = node;
+    
+    split_node_t split_node;
+    int n_by_label[n_subpops];
+    setup_split_node(&split_node, tree, ref_q, item.n_ref, n_by_label);
+
+    int reached = 1;
+    if (lazy) {
+      uint64_t any = 0;
+      for(int w=0; w < n_query_words; w++) any |= query_mask[w];
+      reached = any != 0;
     }
-    else {
-      child_n_ref[0]++;
-      child_n_ref[1]++;
+    
+    double best_si[2];
+    int snp = -1;
+    if (reached)
+      snp = choose_split_snp(tree, snp_q, &item.n_snps, &split_node, item.node_id, item.level,
+			     item.si, best_si);
+    if (snp == -1) {
+      if (reached)
+	node_p(p, tree, &split_node);
+      else
+	for(int k=0; k < n_subpops; k++) p[k] = 0.;
+#if defined(DEBUG_L1) || defined(DEBUG_L2)
+      fprintf(stderr,"[ %4.1f", p[0]);
+      for(int k=1; k < n_subpops; k++)
+	fprintf(stderr,", %4.1f",p[k]);
+      fprintf(stderr," ]\n");
+#endif
+      builder->build_snp_id[node] = -1 - n_leaf_p;
+      builder->build_offset[node] = append_leaf(builder, &n_leaf, &n_leaf_p, p, n_subpops);
+      n_terminal++;
+      continue;
     }
-  }
-
-  for(int j=0; j < 2; j++) {
-    child_ref_q[j] = (int *) ma->allocate(sizeof(int)*(child_n_ref[j]+1), WHEREFROM);
-    child_n_ref[j] = 0;
-  }
-  for(int i=0; i < n_ref; i++) {
-    if (tree->haplotypes[ref_q[i]][snp_q[best_snp]] == 0) {
-      child_ref_q[0][child_n_ref[0]++] = ref_q[i];
+    builder->build_snp_id[node] = snp;
+
+    /* Normal condition - we divide the haplotypes based on SNP snp. Missing data 
+       results in the haplotype going down both branches */
+    int n = item.n_ref;
+    grow_build_q(builder, item.base + 3*n);
+    if (n > builder->build_m_size) {
+      builder->build_m_size = n;
+      RA(builder->build_m, builder->build_m_size, int);
     }
-    else if (tree->haplotypes[ref_q[i]][snp_q[best_snp]] == 1) {
-      child_ref_q[1][child_n_ref[1]++] = ref_q[i];
+    ref_q = builder->build_q + item.base;
+
+    /* Entries going right are packed down in place. Those going left are staged
+       above where the children's entries will end, at ref_q + 2n */
+    int *missing_q = builder->build_m;
+    int *left_q = ref_q + 2*n;
+    int n_right = 0, n_left = 0, n_missing = 0;
+    for(int i=0; i < n; i++) {
+      int e = ref_q[i];
+      int allele = tree->haplotypes[e][snp];
+      if (allele == 1)
+	ref_q[n_right++] = e;
+      else if (allele == 0)
+	left_q[n_left++] = e;
+      else
+	missing_q[n_missing++] = e;
     }
-    else {
-      /* Missing data results in the haplotype going down both branches */
-      child_ref_q[0][child_n_ref[0]++] = ref_q[i];
-      child_ref_q[1][child_n_ref[1]++] = ref_q[i];
+
+    /* Merge the missing data entries into both children */
+    int *q = ref_q + n_right + n_missing;
+    for(int i=0, j=0, k=0; k < n_left + n_missing; k++)
+      q[k] = (j == n_missing || (i < n_left && left_q[i] < missing_q[j])) ? left_q[i++] : missing_q[j++];
+    for(int i=n_right-1, j=n_missing-1, k=n_right+n_missing-1; j >= 0; k--)
+      ref_q[k] = (i >= 0 && ref_q[i] > missing_q[j]) ? ref_q[i--] : missing_q[j--];
+
+    /* The right child takes over this node's slot, SNP queue and mask. The left child
+       gets copies in the next slot */
+    memcpy(snp_q + window->n_snps, snp_q, sizeof(int)*item.n_snps);
+    if (lazy) {
+      for(int w=0; w < n_query_words; w++) {
+	uint64_t a, m;
+	query_bits(&a, &m, window, snp, w);
+	query_mask[n_query_words + w] = query_mask[w] & ~a;
+	query_mask[w] &= a | m;
+      }
     }
+    
+    build_item_t *right = stack + n_stack++;
+    right->parent = node;
+    right->node_id = 2*item.node_id + 1;
+    right->base = item.base;
+    right->n_ref = n_right + n_missing;
+    right->n_snps = item.n_snps;
+    right->level = item.level + 1;
+    right->si = best_si[1];
+
+    build_item_t *left = stack + n_stack++;
+    left->parent = -1;
+    left->node_id = 2*item.node_id;
+    left->base = item.base + n_right + n_missing;
+    left->n_ref = n_left + n_missing;
+    left->n_snps = item.n_snps;
+    left->level = item.level + 1;
+    left->si = best_si[0];
   }
 
-  /* Move the selected SNP to the end of the queue. We'll tell the child calls the 
-     queue is one shorter. Note that this automatically makes the SNP selected at 
-     this level available again for selection when this function returns, meaning
-     higher levels in the tree that start going down the right branch can use it
-     to divide the haplotypes that went that way. */
-  int tmp = snp_q[best_snp];
-  snp_q[best_snp] = snp_q[n_snps-1];
-  snp_q[n_snps-1] = tmp;
-
-  node->left = add_node(tree, snp_q, n_snps-1, child_ref_q[0], child_n_ref[0], best_si[0], ma, level+1);
-  node->right = add_node(tree, snp_q, n_snps-1, child_ref_q[1], child_n_ref[1], best_si[1], ma, level+1);
-  
-  return node;
+  tree->n_nodes = n_nodes;
+  tree->n_terminal = n_terminal;
+  tree->n_leaf = n_leaf;
+  tree->n_leaf_p = n_leaf_p;
+  tree->snp_id = (int *) ma->allocate(sizeof(int)*n_nodes, WHEREFROM);
+  tree->offset = (int *) ma->allocate(sizeof(int)*n_nodes, WHEREFROM);
+  tree->leaf_p = (double *) ma->allocate(sizeof(double)*n_leaf_p, WHEREFROM);
+  memcpy(tree->snp_id, builder->build_snp_id, sizeof(int)*n_nodes);
+  memcpy(tree->offset, builder->build_offset, sizeof(int)*n_nodes);
+  memcpy(tree->leaf_p, builder->build_leaf_p, sizeof(double)*n_leaf_p);
+
+  /* There are no leaf_k entries if every terminal node is dense */
+  tree->leaf_k = NULL;
+  if (n_leaf > 0) {
+    tree->leaf_k = (int *) ma->allocate(sizeof(int)*n_leaf, WHEREFROM);
+    memcpy(tree->leaf_k, builder->build_leaf_k, sizeof(int)*n_leaf);
+  }
 }
 
 static void flat_bootstrap(tree_t *tree, window_t *window) {
   int i;
+  md5rng_stream draws(tree->rng, tree->bootstrap_key, window->idx, tree->rng_idx, window->n_ref_haplotypes);
   for(i=0; i < window->n_ref_haplotypes; i++) {
-    int j = tree->rng->uniform_int(RFOREST_RNG_KEY, window->idx, window->rng_idx++, 0, window->n_ref_haplotypes);
+    int j = draws.uniform_int(0, window->n_ref_haplotypes);
 
-    tree->haplotypes[i] = window->ref_haplotypes[j].haplotype;
-    tree->current_p[i] = window->ref_haplotypes[j].current_p;
+    tree->draws[j]++;
   }
-  tree->n_haplotypes = i;
+  tree->rng_idx = draws.next();
 }
 
 static void hierarchical_bootstrap(tree_t *tree, window_t *window) {
   int i;
+  md5rng_stream draws(tree->rng, tree->bootstrap_key, window->idx, tree->rng_idx, 2*window->n_ref_haplotypes);
   
-  tree->n_haplotypes = 0;
   for(i=0; i < window->n_ref_haplotypes; i++) {
-    int k = tree->rng->uniform_int(RFOREST_RNG_KEY, window->idx, window->rng_idx++, 0, window->n_subpops);
+    int k = draws.uniform_int(0, window->n_subpops);
     int n = window->n_ref_haplotypes_by_subpop[k];
     if (n == 0) { i--; continue; }
     
-    int j = tree->rng->uniform_int(RFOREST_RNG_KEY, window->idx, window->rng_idx++, 0, n);
+    int j = draws.uniform_int(0, n);
     int h = window->ref_haplotype_list[k][j];
 
-    tree->haplotypes[i] = window->ref_haplotypes[h].haplotype;
-    tree->current_p[i] = window->ref_haplotypes[h].current_p;
+    tree->draws[h]++;
   }
-  tree->n_haplotypes = i;
+  tree->rng_idx = draws.next();
 }
 
 static void stratified_bootstrap(tree_t *tree, window_t *window) {
+  md5rng_stream draws(tree->rng, tree->bootstrap_key, window->idx, tree->rng_idx, window->n_ref_haplotypes);
 
-  int h = 0;
   for(int k=0; k < window->n_subpops; k++) {
     int n = window->n_ref_haplotypes_by_subpop[k];
     for(int i=0; i < n; i++) {
-      int j = tree->rng->uniform_int(RFOREST_RNG_KEY, window->idx, window->rng_idx++, 0, n);
+      int j = draws.uniform_int(0, n);
       int t = window->ref_haplotype_list[k][j];
       
-      tree->haplotypes[h] = window->ref_haplotypes[t].haplotype;
-      tree->current_p[h] = window->ref_haplotypes[t].current_p;
-      h++;
+      tree->draws[t]++;
     }
   }
-  tree->n_haplotypes = h;
-  
+  tree->rng_idx = draws.next();
+}
+
+/* Sub-bagging, drawing rfmix_opts.rf_sample_fraction of the reference haplotypes of
+   each subpop without replacement (at least one of each), by a partial Fisher-Yates
+   shuffle of the subpop's list */
+static void stratified_subsample(tree_t *tree, window_t *window, mm *ma) {
+  md5rng_stream draws(tree->rng, tree->bootstrap_key, window->idx, tree->rng_idx,
+		      (int) (rfmix_opts.rf_sample_fraction*window->n_ref_haplotypes) + window->n_subpops);
+
+  for(int k=0; k < window->n_subpops; k++) {
+    int n = window->n_ref_haplotypes_by_subpop[k];
+    if (n == 0) continue;
+
+    int m = (int) (rfmix_opts.rf_sample_fraction*n + 0.5);
+    if (m < 1) m = 1;
+    int *list = (int *) ma->allocate(sizeof(int)*n, WHEREFROM);
+    memcpy(list, window->ref_haplotype_list[k], sizeof(int)*n);
+    for(int i=0; i < m; i++) {
+      int j = draws.uniform_int(i, n);
+      int t = list[j];
+      list[j] = list[i];
+      list[i] = t;
+      
+      tree->draws[t] = 1;
+    }
+  }
+  tree->rng_idx = draws.next();
 }
 
 /* An essential part of the random forest method is that each tree has a "bootstrapped" random 
@@ -457,11 +1119,18 @@ static void stratified_bootstrap(tree_t *tree, window_t *window) {
    the reference data which are not real characteristics of the population they are sampled 
    from but rather artifacts of the random sampling process. This is like how the mean of a
    randomly drawn sample estimates, but typically does not equal, the mean of the entire
-   population. */
+   population. With --rf-sample-fraction below 1, each tree instead draws a fraction of the
+   haplotypes without replacement (sub-bagging), which needs smaller trees to be as 
+   accurate when the reference panel is large. */
 static void bootstrap_haplotypes(input_t *input, tree_t *tree, window_t *window, mm *ma) {
-  tree->haplotypes = (int **) ma->allocate(sizeof(int *)*window->n_ref_haplotypes, WHEREFROM);
-  tree->current_p = (double **) ma->allocate(sizeof(double *)*window->n_ref_haplotypes, WHEREFROM);
-  switch(rfmix_opts.bootstrap_mode) {
+  int n_ref = window->n_ref_haplotypes;
+  int n_subpops = window->n_subpops;
+  int *draws = tree->draws = (int *) ma->allocate(sizeof(int)*n_ref, WHEREFROM);
+  for(int i=0; i < n_ref; i++) draws[i] = 0;
+  
+  if (rfmix_opts.rf_sample_fraction < 1.)
+    stratified_subsample(tree, window, ma);
+  else switch(rfmix_opts.bootstrap_mode) {
   case RF_BOOTSTRAP_FLAT:
     flat_bootstrap(tree, window);
     break;
@@ -475,10 +1144,218 @@ static void bootstrap_haplotypes(input_t *input, tree_t *tree, window_t *window,
     fprintf(stderr,"Runtime error: Unknown bootstrap mode %d in random forest\n", rfmix_opts.bootstrap_mode);
     break;
   }
+
+  /* Gather the counts by unique haplotype */
+  int n_unique = window->n_unique_haplotypes;
+  int *weight = (int *) ma->allocate(sizeof(int)*n_unique, WHEREFROM);
+  for(int u=0; u < n_unique; u++) weight[u] = 0;
+  for(int i=0; i < n_ref; i++) weight[window->ref_haplotypes[i].unique] += draws[i];
+
+  tree->haplotypes = window->unique_haplotypes;
+  tree->label = window->unique_labels;
+  tree->weight = weight;
+  tree->n_haplotypes = n_unique;
+  tree->n_drawn = 0;
+  tree->n_draws = 0;
+  tree->current_p = NULL;
+  for(int u=0; u < n_unique; u++) {
+    if (weight[u] > 0) tree->n_drawn++;
+    tree->n_draws += weight[u];
+  }
+  
+  if (tree->hard_labels) return;
+
+  int n_pad = tree->n_pad = (n_subpops + RF_P_VECTOR - 1) / RF_P_VECTOR * RF_P_VECTOR;
+  tree->current_p = (double *) ma->allocate(sizeof(double)*n_unique*n_pad, WHEREFROM);
+  for(int i=0; i < n_unique*n_pad; i++)
+    tree->current_p[i] = 0.;
+  for(int i=0; i < n_ref; i++) {
+    if (draws[i] == 0) continue;
+    double *p = tree->current_p + window->ref_haplotypes[i].unique*n_pad;
+    for(int k=0; k < n_subpops; k++)
+      p[k] += draws[i]*window->ref_haplotypes[i].current_p[k];
+  }
+}
+
+/* Sets up the window's part of the bitset split engine (see tree_t), the allele
+   and missing data bits and the segments by label of the unique haplotypes, which
+   are the entries of every tree of the window. Unique haplotypes are in order of
+   label with hard labels (see collapse_ref_haplotypes()). */
+static void setup_window_split_bits(window_t *window, mm *ma) {
+  int i, k;
+  int n = window->n_unique_haplotypes;
+  int n_subpops = window->n_subpops;
+  int n_snps = window->n_snps;
+  int start[n_subpops + 1];
+
+  int n_words = (n + 63) >> 6;
+  window->n_split_words = n_words;
+  window->allele_bits = (uint64_t *) ma->allocate(sizeof(uint64_t)*2*n_snps*n_words, WHEREFROM);
+  window->missing_bits = window->allele_bits + (size_t) n_snps*n_words;
+  memset(window->allele_bits, 0, sizeof(uint64_t)*2*n_snps*n_words);
+  for(i=0; i < n; i++) {
+    int *haplotype = window->unique_haplotypes[i];
+    uint64_t bit = (uint64_t) 1 << (i & 0x3F);
+    for(int s=0; s < n_snps; s++) {
+      if (haplotype[s] == 1)
+	window->allele_bits[(size_t) s*n_words + (i >> 6)] |= bit;
+      else if (haplotype[s] != 0)
+	window->missing_bits[(size_t) s*n_words + (i >> 6)] |= bit;
+    }
+  }
+
+  window->n_segments = 0;
+  window->seg_first = NULL;
+  if (!window->hard_labels) return;
+  
+  /* start[k] is the first unique haplotype of label k */
+  for(k=0; k <= n_subpops; k++) start[k] = 0;
+  for(i=0; i < n; i++) start[window->unique_labels[i] + 1]++;
+  for(k=0; k < n_subpops; k++) start[k+1] += start[k];
+
+  /* Break each subpop's range of entries into per word segments */
+  int max_segments = n_words + n_subpops;
+  window->seg_word = (int *) ma->allocate(sizeof(int)*max_segments, WHEREFROM);
+  window->seg_subpop = (int *) ma->allocate(sizeof(int)*max_segments, WHEREFROM);
+  window->seg_mask = (uint64_t *) ma->allocate(sizeof(uint64_t)*max_segments, WHEREFROM);
+  window->seg_first = (int *) ma->allocate(sizeof(int)*(n_words + 1), WHEREFROM);
+  
+  int ns = 0;
+  for(k=0; k < n_subpops; k++) {
+    int a = start[k];
+    while(a < start[k+1]) {
+      int w = a >> 6;
+      int b = start[k+1] < (w + 1) << 6 ? start[k+1] : (w + 1) << 6;
+      uint64_t mask = b - a == 64 ? ~(uint64_t) 0 : (((uint64_t) 1 << (b - a)) - 1) << (a & 0x3F);
+      window->seg_word[ns] = w;
+      window->seg_subpop[ns] = k;
+      window->seg_mask[ns] = mask;
+      ns++;
+      a = b;
+    }
+  }
+  window->n_segments = ns;
+
+  int t = 0;
+  for(int w=0; w <= n_words; w++) {
+    while(t < ns && window->seg_word[t] < w) t++;
+    window->seg_first[w] = t;
+  }
+}
+
+/* Sets up the SNPs trees may split on (see choose_split_snp()), leaving out those
+   whose minor allele is on fewer than rfmix_opts.rf_min_mac reference haplotypes,
+   which can never or almost never divide a node into two children larger than the
+   node size. With rfmix_opts.rf_collapse_ld, SNPs dividing the unique haplotypes 
+   the same way as an earlier SNP, with the same or switched alleles, are left out 
+   too, as they only differ in the query haplotypes. */
+static void setup_split_snps(window_t *window, mm *ma) {
+  int n_snps = window->n_snps;
+  int n_words = window->n_split_words;
+  int n_unique = window->n_unique_haplotypes;
+  
+  window->split_snps = (int *) ma->allocate(sizeof(int)*n_snps, WHEREFROM);
+  window->n_split_snps = 0;
+
+  /* Allele counts are of the reference haplotypes, counting every haplotype 
+     collapsed to a unique haplotype */
+  int *n_collapsed = (int *) ma->allocate(sizeof(int)*n_unique, WHEREFROM);
+  for(int u=0; u < n_unique; u++) n_collapsed[u] = 0;
+  for(int i=0; i < window->n_ref_haplotypes; i++) n_collapsed[window->ref_haplotypes[i].unique]++;
+
+  /* The pattern of a SNP is its allele bits, switched so that the first unique
+     haplotype without missing data has allele 0, followed by its missing data bits.
+     Patterns of the SNPs kept are in a hash table by index in window->split_snps */
+  uint64_t *patterns = NULL;
+  int *table = NULL;
+  int size = 64;
+  if (rfmix_opts.rf_collapse_ld) {
+    while(size < n_snps*2) size <<= 1;
+    table = (int *) ma->allocate(sizeof(int)*size, WHEREFROM);
+    for(int i=0; i < size; i++) table[i] = -1;
+    patterns = (uint64_t *) ma->allocate(sizeof(uint64_t)*2*n_words*n_snps, WHEREFROM);
+  }
+  
+  for(int s=0; s < n_snps; s++) {
+    uint64_t *a = window->allele_bits + (size_t) s*n_words;
+    uint64_t *m = window->missing_bits + (size_t) s*n_words;
+    int c[2] = { 0, 0 };
+    
+    for(int u=0; u < n_unique; u++) {
+      uint64_t bit = (uint64_t) 1 << (u & 0x3F);
+      if (!(m[u >> 6] & bit)) c[(a[u >> 6] & bit) != 0] += n_collapsed[u];
+    }
+    if ((c[0] < c[1] ? c[0] : c[1]) < rfmix_opts.rf_min_mac) continue;
+
+    if (rfmix_opts.rf_collapse_ld) {
+      uint64_t *pattern = patterns + (size_t) window->n_split_snps*2*n_words;
+      uint64_t flip = 0;
+      for(int w=0; w < n_words; w++) {
+	uint64_t present = ~m[w];
+	if (w == n_words - 1 && (n_unique & 0x3F)) present &= ((uint64_t) 1 << (n_unique & 0x3F)) - 1;
+	if (present != 0) {
+	  flip = (a[w] >> __builtin_ctzll(present)) & 1 ? ~(uint64_t) 0 : 0;
+	  break;
+	}
+      }
+      uint64_t h = 0xCBF29CE484222325ULL;
+      for(int w=0; w < n_words; w++) {
+	uint64_t present = ~m[w];
+	if (w == n_words - 1 && (n_unique & 0x3F)) present &= ((uint64_t) 1 << (n_unique & 0x3F)) - 1;
+	pattern[w] = (a[w] ^ flip) & present;
+	pattern[n_words + w] = m[w];
+	h = (h ^ pattern[w]) * 0x100000001B3ULL;
+	h = (h ^ m[w]) * 0x100000001B3ULL;
+      }
+
+      int t = h & (size - 1);
+      while(table[t] != -1 &&
+	    memcmp(patterns + (size_t) table[t]*2*n_words, pattern, sizeof(uint64_t)*2*n_words) != 0)
+	t = (t + 1) & (size - 1);
+      if (table[t] != -1) continue;
+      table[t] = window->n_split_snps;
+    }
+    window->split_snps[window->n_split_snps++] = s;
+  }
 }
 
+/* Sets up the tree's part of the bitset split engine, its node bits and weight bit
+   planes, after the window's shared part */
+static void setup_split_bits(tree_t *tree, window_t *window, tree_builder_t *builder) {
+  int n = tree->n_haplotypes;
+  int n_words = window->n_split_words;
+
+  tree->n_words = n_words;
+  tree->allele_bits = window->allele_bits;
+  tree->missing_bits = window->missing_bits;
+  tree->node_bits = builder->split_bits;
+  tree->n_segments = window->n_segments;
+  tree->seg_first = window->seg_first;
+  tree->seg_word = window->seg_word;
+  tree->seg_subpop = window->seg_subpop;
+  tree->seg_mask = window->seg_mask;
+  tree->n_planes = 0;
+  if (!tree->hard_labels) return;
+
+  int max_weight = 0;
+  for(int i=0; i < n; i++)
+    if (tree->weight[i] > max_weight) max_weight = tree->weight[i];
+  if (max_weight > 1) {
+    while(max_weight >> tree->n_planes) tree->n_planes++;
+    tree->weight_bits = tree->node_bits + n_words;
+    memset(tree->weight_bits, 0, sizeof(uint64_t)*tree->n_planes*n_words);
+    for(int i=0; i < n; i++) {
+      for(int b=0; b < tree->n_planes; b++) {
+	if ((tree->weight[i] >> b) & 1)
+	  tree->weight_bits[b*n_words + (i >> 6)] |= (uint64_t) 1 << (i & 0x3F);
+      }
+    }
+  }
+}
 
-static tree_t *build_tree(input_t *input, window_t *window, md5rng *rng, mm *ma) {
+static tree_t *build_tree(input_t *input, window_t *window, tree_builder_t *builder, int tree_idx,
+			  md5rng *rng) {
+  mm *ma = builder->ma;
   int i;
   tree_t *tree = (tree_t *) ma->allocate(sizeof(tree_t), WHEREFROM);
 
@@ -488,90 +1365,572 @@ static tree_t *build_tree(input_t *input, window_t *window, md5rng *rng, mm *ma)
   tree->window_idx = window->idx,
   tree->n_subpops = window->n_subpops;
   tree->rng = rng;
-  tree->rng_idx = window->rng_idx;
+  tree->rng_key = rng->uint32(RFOREST_RNG_KEY, window->idx, tree_idx);
+  tree->bootstrap_key = rng->uint32(tree->rng_key, window->idx, 0);
+  tree->rng_idx = 0;
+  tree->hard_labels = window->hard_labels;
+  tree->p_label = window->p_label;
+  tree->p_other = window->p_other;
 
   /* Randomly select, with replacement, reference haplotypes for this tree. See above. */
   bootstrap_haplotypes(input, tree, window, ma);
-  int *ref_q = (int *) ma->allocate(sizeof(int)*tree->n_haplotypes, WHEREFROM);
+  setup_split_bits(tree, window, builder);
+  grow_build_q(builder, 2*tree->n_drawn);
+  int *ref_q = builder->build_q;
   for(i=0; i < tree->n_haplotypes; i++)
-    ref_q[i] = i;
+    if (tree->weight[i] > 0) *ref_q++ = i;
+  ref_q = builder->build_q;
 
-  /* All SNPs in the RF window are candidates, only a random subsample are evaluated
-     at each node. See add_node() above. */
-  int *snp_q = (int *) ma->allocate(sizeof(int)*window->n_snps, WHEREFROM);
-  for(i=0; i < window->n_snps; i++)
-    snp_q[i] = i;
+  /* All SNPs in the RF window that may split are candidates, only a random subsample
+     are evaluated at each node. See choose_split_snp() above. */
+  int *snp_q = builder->build_snp_q;
+  for(i=0; i < window->n_split_snps; i++)
+    snp_q[i] = window->split_snps[i];
+  for(i=0; i < window->n_query_words; i++)
+    builder->build_query_mask[i] = window->query_mask[i];
 
   /* Initialize the shannon information of all bootstrap-selected reference haplotypes
      present at the start (root node) of the tree, and build the tree */
   double p[window->n_subpops];
-  for(int k=0; k < window->n_subpops; k++)
-    p[k] = 0.;
-  for(i=0; i < tree->n_haplotypes; i++) {
-    for(int k=0; k < window->n_subpops; k++)
-      p[k] += tree->current_p[i][k];
-  }
-  double si = shannon_information(p, tree->n_haplotypes, window->n_subpops);
-  tree->root = add_node(tree, snp_q, window->n_snps, ref_q, tree->n_haplotypes,
-			si, ma, 0);
+  int n_by_label[window->n_subpops];
+  split_node_t root;
+  setup_split_node(&root, tree, ref_q, tree->n_drawn, n_by_label);
+  node_p(p, tree, &root);
+  double si = shannon_information(p, tree->n_draws, window->n_subpops);
+  grow_tree(tree, window, builder, window->n_split_snps, si);
 
-  /* The random number generator sequence index is increased during tree building, copy
-     the incremented value back to the window */
-  window->rng_idx = tree->rng_idx;
   return tree;
 }
 
-static void evaluate_tree(double *p, int *d, int *haplotype, node_t *node, int n_subpops) {
-  
-  if (node->snp_id == -1) {
+/* Quantizes the p vector of the tree's terminal node i into x[], its minimum in x[0]
+   and the amount above it of subpop k in x[k+1], returning the number of subpops 
+   still above the minimum and a subpop at the minimum in *m */
+static int quantize_leaf(uint16_t *x, int *m, forest_t *forest, tree_t *tree, int i) {
+  int n_subpops = forest->n_subpops;
+  int o = tree->offset[i];
+  double *leaf_p = tree->leaf_p - 1 - tree->snp_id[i];
+  int n = 0;
+
+  for(int k=0; k < n_subpops; k++)
+    x[k+1] = 0;
+  if (o < 0) {
+    x[0] = (uint16_t) (leaf_p[-1 - o]/forest->leaf_scale + 0.5);
     for(int k=0; k < n_subpops; k++)
-      p[k] += node->p[k];
-    (*d)++;
+      if (k != -1 - o) x[k+1] = (uint16_t) (leaf_p[k]/forest->leaf_scale + 0.5);
+  } else {
+    int *leaf_k = tree->leaf_k + o;
+    x[0] = (uint16_t) (leaf_p[0]/forest->leaf_scale + 0.5);
+    for(int j=1; j <= leaf_k[0]; j++)
+      x[leaf_k[j]+1] = (uint16_t) (leaf_p[j]/forest->leaf_scale + 0.5);
+  }
+  *m = -1;
+  for(int k=0; k < n_subpops; k++) {
+    if (x[k+1] != 0) n++;
+    else if (*m == -1) *m = k;
+  }
+
+  return n;
+}
+
+/* Appends the quantized p vector x[] with n subpops above its minimum, subpop m 
+   among those at it (see quantize_leaf()), to the forest's leaf entries, *n_leaf of
+   leaf_k and *n_leaf_p of leaf_q so far, returning its offset. Its values start at
+   the old *n_leaf_p. With leaf_q NULL only counts the entries */
+static int append_quantized_leaf(forest_t *forest, uint16_t *x, int n, int m, int *n_leaf,
+				 int *n_leaf_p) {
+  int n_subpops = forest->n_subpops;
+  uint16_t *leaf_q = forest->leaf_q + *n_leaf_p;
+
+  if (dense_leaf(n, n_subpops, sizeof(uint16_t))) {
+    if (forest->leaf_q != NULL) {
+      for(int k=0; k < n_subpops; k++)
+	leaf_q[k] = x[k+1];
+      leaf_q[m] = x[0];
+    }
+    *n_leaf_p += n_subpops;
+    return -1 - m;
+  }
+
+  int o = *n_leaf;
+  if (forest->leaf_q != NULL) {
+    int *leaf_k = forest->leaf_k + o;
+    leaf_k[0] = n;
+    leaf_q[0] = x[0];
+    for(int k=0, i=1; k < n_subpops; k++) {
+      if (x[k+1] == 0) continue;
+      leaf_k[i] = k;
+      leaf_q[i++] = x[k+1];
+    }
+  }
+  *n_leaf += n + 1;
+  *n_leaf_p += n + 1;
+
+  return o;
+}
+
+/* With rfmix_opts.rf_quantize_leaves, the leaf entries of the forest are quantized to
+   16 bits on a scale set by the largest, and entries above the minimum of a p vector
+   that come to 0 are dropped, so that p vectors of soft labels become sparse too. 
+   Whether each is then stored sparsely is decided again (see dense_leaf()) */
+static forest_t *compile_forest(tree_t **trees, int n_trees, int n_subpops, mm *ma) {
+  forest_t *forest = (forest_t *) ma->allocate(sizeof(forest_t), WHEREFROM);
+  int n_nodes = 0;
+  int n_terminal = 0;
+  int n_leaf = 0;
+  int n_leaf_p = 0;
+  double max_p = 0.;
+  uint16_t x[n_subpops + 1];
+  int m;
+
+  for(int t=0; t < n_trees; t++) {
+    n_nodes += trees[t]->n_nodes;
+    n_terminal += trees[t]->n_terminal;
+    n_leaf += trees[t]->n_leaf;
+    n_leaf_p += trees[t]->n_leaf_p;
+    for(int i=0; i < trees[t]->n_leaf_p; i++)
+      if (trees[t]->leaf_p[i] > max_p) max_p = trees[t]->leaf_p[i];
+  }
+  
+  forest->n_trees = n_trees;
+  forest->n_subpops = n_subpops;
+  forest->n_nodes = n_nodes;
+  forest->n_terminal = n_terminal;
+  forest->root = (int *) ma->allocate(sizeof(int)*n_trees, WHEREFROM);
+  forest->nodes = (forest_node_t *) ma->allocate(sizeof(forest_node_t)*n_nodes, WHEREFROM);
+  forest->leaf_p = NULL;
+  forest->leaf_q = NULL;
+  forest->leaf_scale = 0.;
+  if (rfmix_opts.rf_quantize_leaves) {
+    /* Count the quantized entries first */
+    forest->leaf_scale = max_p > 0. ? max_p/65535. : 1.;
+    n_leaf = 0;
+    n_leaf_p = 0;
+    for(int t=0; t < n_trees; t++) {
+      tree_t *tree = trees[t];
+      for(int i=0; i < tree->n_nodes; i++) {
+	if (tree->snp_id[i] >= 0) continue;
+	int n = quantize_leaf(x, &m, forest, tree, i);
+	append_quantized_leaf(forest, x, n, m, &n_leaf, &n_leaf_p);
+      }
+    }
+    forest->leaf_q = (uint16_t *) ma->allocate(sizeof(uint16_t)*n_leaf_p, WHEREFROM);
+  } else {
+    forest->leaf_p = (double *) ma->allocate(sizeof(double)*n_leaf_p, WHEREFROM);
+  }
+  forest->leaf_k = NULL;
+  if (n_leaf > 0)
+    forest->leaf_k = (int *) ma->allocate(sizeof(int)*n_leaf, WHEREFROM);
+  forest->n_leaf = n_leaf;
+  forest->n_leaf_p = n_leaf_p;
+
+  int node_base = 0;
+  int leaf_base = 0;
+  int leaf_p_base = 0;
+  for(int t=0; t < n_trees; t++) {
+    tree_t *tree = trees[t];
+    forest_node_t *nodes = forest->nodes + node_base;
+    
+    forest->root[t] = node_base;
+    if (forest->leaf_q == NULL) {
+      if (tree->n_leaf > 0)
+	memcpy(forest->leaf_k + leaf_base, tree->leaf_k, sizeof(int)*tree->n_leaf);
+      memcpy(forest->leaf_p + leaf_p_base, tree->leaf_p, sizeof(double)*tree->n_leaf_p);
+    }
+    for(int i=0; i < tree->n_nodes; i++) {
+      nodes[i].snp_id = tree->snp_id[i];
+      if (tree->snp_id[i] >= 0) {
+	nodes[i].offset = tree->offset[i] + node_base;
+      } else if (forest->leaf_q == NULL) {
+	nodes[i].snp_id -= leaf_p_base;
+	nodes[i].offset = tree->offset[i] + (tree->offset[i] >= 0 ? leaf_base : 0);
+      } else {
+	int n = quantize_leaf(x, &m, forest, tree, i);
+	nodes[i].snp_id = -1 - leaf_p_base;
+	nodes[i].offset = append_quantized_leaf(forest, x, n, m, &leaf_base, &leaf_p_base);
+      }
+    }
+    if (forest->leaf_q == NULL) {
+      leaf_base += tree->n_leaf;
+      leaf_p_base += tree->n_leaf_p;
+    }
+    node_base += tree->n_nodes;
+  }
+
+  return forest;
+}
+
+/* Adds the p vector of terminal node i (see tree_t) to p[], but for its minimum,
+   which is added once to p[n_subpops] for evaluate_forest() to add to every subpop.
+   The cost is then the number of subpops above the minimum, or n_subpops for a dense
+   p vector. */
+static inline void add_leaf_p(double *p, forest_t *forest, int i) {
+  int o = forest->nodes[i].offset;
+  int v = -1 - forest->nodes[i].snp_id;
+  int n_subpops = forest->n_subpops;
+
+  if (forest->leaf_q == NULL) {
+    double *leaf_p = forest->leaf_p + v;
+    if (o < 0) {
+      int m = -1 - o;
+      p[n_subpops] += leaf_p[m];
+      for(int k=0; k < n_subpops; k++)
+	if (k != m) p[k] += leaf_p[k];
+    } else {
+      int *leaf_k = forest->leaf_k + o;
+      p[n_subpops] += leaf_p[0];
+      for(int j=1; j <= leaf_k[0]; j++)
+	p[leaf_k[j]] += leaf_p[j];
+    }
+  } else {
+    uint16_t *leaf_q = forest->leaf_q + v;
+    double scale = forest->leaf_scale;
+    if (o < 0) {
+      int m = -1 - o;
+      p[n_subpops] += leaf_q[m]*scale;
+      for(int k=0; k < n_subpops; k++)
+	if (k != m) p[k] += leaf_q[k]*scale;
+    } else {
+      int *leaf_k = forest->leaf_k + o;
+      p[n_subpops] += leaf_q[0]*scale;
+      for(int j=1; j <= leaf_k[0]; j++)
+	p[leaf_k[j]] += leaf_q[j]*scale;
+    }
+  }
+}
+
+/* Adds the p vectors of the terminal nodes of tree t that <haplotype> reaches to 
+   est_p[]. Missing data at a node sends the haplotype down both branches, in which 
+   case the average of the p vectors of the terminal nodes reached is added. Otherwise
+   trees where missing data results in multiple terminal nodes being used would in 
+   effect have a higher weight where fewer (one ideally) terminal nodes were reached. */
+static void evaluate_tree(double *est_p, int *haplotype, forest_t *forest, int t) {
+  forest_node_t *nodes = forest->nodes;
+  int n_subpops = forest->n_subpops;
+  int stack[RF_MAX_TREE_LEVEL + 1];
+  int n_stack = 0;
+  int node = forest->root[t];
+  
+  /* The usual case, one terminal node reached */
+  for(;;) {
+    int snp_id = nodes[node].snp_id;
+    if (snp_id < 0) {
+      add_leaf_p(est_p, forest, node);
+      return;
+    }
+
+    int allele = haplotype[snp_id];
+    if (allele == 0)
+      node = node + 1;
+    else if (allele == 1)
+      node = nodes[node].offset;
+    else
+      break;
+  }
+  
+  /* Missing data - walk both branches depth first, left before right, summing the
+     terminal node p vectors reached in p[] and counting them in d */
+  double p[n_subpops + 1];
+  int d = 0;
+  for(int k=0; k <= n_subpops; k++) p[k] = 0.;
+  for(;;) {
+    int snp_id = nodes[node].snp_id;
+    if (snp_id < 0) {
+      add_leaf_p(p, forest, node);
+      d++;
+      if (n_stack == 0) break;
+      node = stack[--n_stack];
+      continue;
+    }
+
+    int allele = haplotype[snp_id];
+    if (allele == 0)
+      node = node + 1;
+    else if (allele == 1)
+      node = nodes[node].offset;
+    else if (allele == 2) {
+      stack[n_stack++] = nodes[node].offset;
+      node = node + 1;
+    }
+    else {
+      if (n_stack == 0) break;
+      node = stack[--n_stack];
+    }
+  }
+
+  for(int k=0; k <= n_subpops; k++)
+    est_p[k] += p[k]/(double) d;
+}
+
+/* Evaluates the up to 64 query haplotypes of word w of the window's query bits on
+   tree t at once. The haplotypes go down the tree together as masks, split at each
+   node by the allele bits of its SNP (see query_bits()), and the p vector of each
+   terminal node reached is added to est_p[] of each haplotype in the mask reaching
+   it. Phase flipped haplotypes thus share the path of their originals down to where
+   they diverge. A haplotype with missing data at a node it reaches is dropped from
+   the masks instead, and returned set in the result for evaluate_tree() to
+   evaluate. */
+static uint64_t evaluate_tree_bits(double **est_p, forest_t *forest, int t, window_t *window, int w) {
+  forest_node_t *nodes = forest->nodes;
+  int stack_node[RF_MAX_TREE_LEVEL + 1];
+  uint64_t stack_mask[RF_MAX_TREE_LEVEL + 1];
+  int n_stack = 0;
+  uint64_t missing = 0;
+  uint64_t mask = window->query_mask[w];
+  int node = forest->root[t];
+
+  for(;;) {
+    int snp_id = nodes[node].snp_id;
+    if (snp_id < 0) {
+      for(uint64_t m = mask; m != 0; m &= m - 1)
+	add_leaf_p(est_p[__builtin_ctzll(m)], forest, node);
+    } else {
+      uint64_t a, m;
+      query_bits(&a, &m, window, snp_id, w);
+      uint64_t left = mask & ~a & ~m;
+      uint64_t right = mask & a & ~m;
+      missing |= mask & m;
+
+      if (left != 0 && right != 0) {
+	stack_node[n_stack] = nodes[node].offset;
+	stack_mask[n_stack++] = right;
+      }
+      if (left != 0) {
+	node = node + 1;
+	mask = left;
+	continue;
+      }
+      if (right != 0) {
+	node = nodes[node].offset;
+	mask = right;
+	continue;
+      }
+    }
+    
+    if (n_stack == 0) break;
+    node = stack_node[--n_stack];
+    mask = stack_mask[n_stack];
+  }
+
+  return missing;
+}
+
+/* FNV-1a hash of a haplotype's alleles over the window, and its label */
+static uint64_t hash_haplotype(int *haplotype, int n_snps, int label) {
+  uint64_t h = 0xCBF29CE484222325ULL;
+
+  for(int s=0; s < n_snps; s++) {
+    h ^= (uint64_t) haplotype[s];
+    h *= 0x100000001B3ULL;
+  }
+  h ^= (uint64_t) (label + 1);
+  h *= 0x100000001B3ULL;
+  return h;
+}
+
+/* FNV-1a hash of a haplotype's alleles from SNP start to end-1 */
+static uint64_t hash_alleles(int *haplotype, int start, int end) {
+  uint64_t h = 0xCBF29CE484222325ULL;
+
+  for(int s=start; s < end; s++) {
+    h ^= (uint64_t) haplotype[s];
+    h *= 0x100000001B3ULL;
+  }
+  return h;
+}
+
+/* Sets up the distinct query haplotypes of the window as bits (see window_t), with 
+   the same layout as the bitset split engine's. Close relatives and haplotypes 
+   identical by descent are often the same over a window, as are the phase flipped 
+   haplotypes of a sample homozygous on one side of the CRF point, and are only 
+   evaluated once. Haplotypes are hashed by the halves before and after the phase 
+   flip SNP, so that the phase flipped haplotypes' hashes come from those of 
+   haplotypes 0 and 1 without hashing their alleles again.
+
+   Haplotype 2 of a sample has the alleles of haplotype 0 before the flip SNP, and 3
+   those of 1. Where both a phase flipped haplotype and that original are distinct,
+   the pair takes bits b and b+32 of a word, and the flipped haplotype only has its
+   own bits from the flip SNP on, before which it follows the original (see
+   query_bits()). The other distinct haplotypes fill the remaining bits. */
+static void setup_query_bits(window_t *window, mm *ma) {
+  int n_all = 4*window->n_query_samples;
+  int n_snps = window->n_snps;
+
+  /* rfmix train has no query haplotypes, and with --hierarchy a window may have none
+     that are analyzed in it */
+  int n_analyzed = 0;
+  for(int i=0; i < n_all; i++)
+    n_analyzed += window->query_samples[i >> 2].analyzed[i & 0x3];
+  if (n_analyzed == 0) {
+    window->n_query_haplotypes = 0;
+    window->n_query_words = 0;
+    window->query_est_p = NULL;
+    window->query_haplotypes = NULL;
+    window->query_allele_bits = NULL;
+    window->query_missing_bits = NULL;
+    window->query_mask = NULL;
+    window->query_flip_bits = NULL;
+    window->query_flip_snp = 0;
+    window->n_query_duplicates = 0;
     return;
   }
   
-  int allele = haplotype[node->snp_id];
-  if (allele == 0)
-    evaluate_tree(p, d, haplotype, node->left, n_subpops);
-  else if (allele == 1)
-    evaluate_tree(p, d, haplotype, node->right, n_subpops);
-  else if (allele == 2) {
-    evaluate_tree(p, d, haplotype, node->left, n_subpops);
-    evaluate_tree(p, d, haplotype, node->right, n_subpops);
+  int **list = (int **) ma->allocate(sizeof(int *)*n_all, WHEREFROM);
+  double **list_est_p = (double **) ma->allocate(sizeof(double *)*n_all, WHEREFROM);
+  int *distinct = (int *) ma->allocate(sizeof(int)*n_all, WHEREFROM);
+  window->query_duplicate_est_p = (double **) ma->allocate(sizeof(double *)*n_all, WHEREFROM);
+  window->query_duplicate_of = (int *) ma->allocate(sizeof(int)*n_all, WHEREFROM);
+  window->n_query_duplicates = 0;
+  
+  int size = 64;
+  while(size < n_all*2) size <<= 1;
+  int *table = (int *) ma->allocate(sizeof(int)*size, WHEREFROM);
+  for(int i=0; i < size; i++) table[i] = -1;
+
+  /* distinct[i] is the index in list[] of haplotype i & 0x3 of query sample i >> 2, 
+     or -1 if it is not analyzed or identical to an earlier one */
+  int n_distinct = 0;
+  uint64_t half_hash[2][2];
+  for(int i=0; i < n_all; i++) {
+    wsample_t *wsample = window->query_samples + (i >> 2);
+    int *h = wsample->haplotype[i & 0x3];
+
+    if ((i & 0x3) == 0) {
+      for(int k=0; k < 2; k++) {
+	half_hash[k][0] = hash_alleles(wsample->haplotype[k], 0, wsample->flip_snp);
+	half_hash[k][1] = hash_alleles(wsample->haplotype[k], wsample->flip_snp, n_snps);
+      }
+    }
+    /* Not of the ancestry analyzed in this window, see restrict_hierarchy_level() */
+    if (!wsample->analyzed[i & 0x3]) {
+      distinct[i] = -1;
+      continue;
+    }
+    
+    /* Haplotype 2 is the first half of haplotype 0 and second of 1, 3 the reverse */
+    int first = i & 0x1, second = (i & 0x3) < 2 ? i & 0x1 : (i & 0x1) ^ 1;
+    uint64_t hash = half_hash[first][0]*0x9E3779B97F4A7C15ULL ^ half_hash[second][1];
+    int t = hash & (size - 1);
+    
+    while(table[t] != -1 && memcmp(list[table[t]], h, sizeof(int)*n_snps) != 0)
+      t = (t + 1) & (size - 1);
+    if (table[t] != -1) {
+      window->query_duplicate_est_p[window->n_query_duplicates] = wsample->est_p[i & 0x3];
+      window->query_duplicate_of[window->n_query_duplicates++] = table[t];
+      distinct[i] = -1;
+      continue;
+    }
+    table[t] = n_distinct;
+    distinct[i] = n_distinct;
+    list_est_p[n_distinct] = wsample->est_p[i & 0x3];
+    list[n_distinct++] = h;
+  }
+
+  int n_pairs = 0;
+  for(int i=0; i < n_all; i += 4) {
+    for(int k=0; k < 2; k++)
+      if (distinct[i+k] != -1 && distinct[i+k+2] != -1) n_pairs++;
+  }
+  int n_words = (n_pairs + 31) >> 5;
+  if (n_words < (n_distinct + 63) >> 6) n_words = (n_distinct + 63) >> 6;
+  int n_haplotypes = n_words << 6;
+  int flip = window->query_samples[0].flip_snp;
+
+  double **est_p = (double **) ma->allocate(sizeof(double *)*n_haplotypes, WHEREFROM);
+  int **haplotype = (int **) ma->allocate(sizeof(int *)*n_haplotypes, WHEREFROM);
+  uint64_t *mask = (uint64_t *) ma->allocate(sizeof(uint64_t)*n_words, WHEREFROM);
+  uint64_t *flip_bits = (uint64_t *) ma->allocate(sizeof(uint64_t)*n_words, WHEREFROM);
+  int *position = (int *) ma->allocate(sizeof(int)*n_distinct, WHEREFROM);
+  for(int j=0; j < n_haplotypes; j++) {
+    est_p[j] = NULL;
+    haplotype[j] = NULL;
   }
+  for(int w=0; w < n_words; w++) {
+    mask[w] = 0;
+    flip_bits[w] = 0;
+  }
+  for(int d=0; d < n_distinct; d++) position[d] = -1;
+
+  int n = 0;
+  for(int i=0; i < n_all; i += 4) {
+    for(int k=0; k < 2; k++) {
+      int d = distinct[i+k], f = distinct[i+k+2];
+      if (d == -1 || f == -1) continue;
+      int w = n >> 5, b = n & 0x1F;
+      position[d] = (w << 6) + b;
+      position[f] = (w << 6) + b + 32;
+      mask[w] |= (uint64_t) 1 << b | (uint64_t) 1 << (b + 32);
+      flip_bits[w] |= (uint64_t) 1 << (b + 32);
+      n++;
+    }
+  }
+  int j = 0;
+  for(int d=0; d < n_distinct; d++) {
+    if (position[d] != -1) continue;
+    while((mask[j >> 6] >> (j & 0x3F)) & 1) j++;
+    position[d] = j;
+    mask[j >> 6] |= (uint64_t) 1 << (j & 0x3F);
+  }
+  for(int d=0; d < n_distinct; d++) {
+    est_p[position[d]] = list_est_p[d];
+    haplotype[position[d]] = list[d];
+  }
+  for(int d=0; d < window->n_query_duplicates; d++)
+    window->query_duplicate_of[d] = position[window->query_duplicate_of[d]];
+  
+  uint64_t *allele_bits = (uint64_t *) ma->allocate(sizeof(uint64_t)*n_snps*n_words, WHEREFROM);
+  uint64_t *missing_bits = (uint64_t *) ma->allocate(sizeof(uint64_t)*n_snps*n_words, WHEREFROM);
+  memset(allele_bits, 0, sizeof(uint64_t)*n_snps*n_words);
+  memset(missing_bits, 0, sizeof(uint64_t)*n_snps*n_words);
+  
+  for(j=0; j < n_haplotypes; j++) {
+    if (haplotype[j] == NULL) continue;
+    uint64_t bit = (uint64_t) 1 << (j & 0x3F);
+    int start = (flip_bits[j >> 6] & bit) ? flip : 0;
+    for(int s=start; s < n_snps; s++) {
+      if (haplotype[j][s] == 1)
+	allele_bits[s*n_words + (j >> 6)] |= bit;
+      else if (haplotype[j][s] != 0)
+	missing_bits[s*n_words + (j >> 6)] |= bit;
+    }
+  }
+
+  window->n_query_haplotypes = n_haplotypes;
+  window->n_query_words = n_words;
+  window->query_est_p = est_p;
+  window->query_haplotypes = haplotype;
+  window->query_allele_bits = allele_bits;
+  window->query_missing_bits = missing_bits;
+  window->query_mask = mask;
+  window->query_flip_bits = flip_bits;
+  window->query_flip_snp = flip;
 }
 
-static void evaluate_sample(wsample_t *wsample, window_t *window, tree_t **trees, int n_trees) {
+/* Evaluates the query haplotypes in words w_start to w_end-1 of the window's query
+   bits, tree by tree so that each tree stays in cache while every query haplotype
+   is evaluated on it. The haplotypes are evaluated 64 at a time with 
+   evaluate_tree_bits(). */
+static void evaluate_forest(window_t *window, forest_t *forest, int w_start, int w_end) {
+  double **est_p = window->query_est_p;
+  int **haplotype = window->query_haplotypes;
   
-  for(int h=0; h < 4; h++) {
-    for(int t=0; t < n_trees; t++) {
-      double p[window->n_subpops];
-      for(int k=0; k < window->n_subpops; k++) p[k] = 0.;
-      
-      /* This is tricky - because of missing data, some trees might add the terminal node p vector
-	 of several nodes, not just one. d is incremented by evaluate_tree() at every terminal 
-	 node that it adds to p[]. After the return of the call below, we then merge the p vector
-	 into est_p[h][] and divide it by the number of terminal nodes that were used by the tree.
-	 This is necessary otherwise trees where missing data results in multiple terminal nodes
-	 being used would in effect have a higher weight where fewer (one ideally) terminal 
-         nodes were reached. */
-      int d = 0;
-      evaluate_tree(p, &d, wsample->haplotype[h], trees[t]->root, window->n_subpops);
-      
-      for(int k=0; k < window->n_subpops; k++) {
-	  wsample->est_p[h][k] += p[k]/(double) d;
+  for(int t=0; t < forest->n_trees; t++) {
+    for(int w=w_start; w < w_end; w++) {
+      uint64_t missing = evaluate_tree_bits(est_p + (w << 6), forest, t, window, w);
+      for(; missing != 0; missing &= missing - 1) {
+	int j = (w << 6) + __builtin_ctzll(missing);
+	evaluate_tree(est_p[j], haplotype[j], forest, t);
       }
     }
+  }
 
-    /* Normalize to probabilities that sum to one across all subpops. */
-    normalize_vector(wsample->est_p[h], window->n_subpops);
-#ifdef DEBUG_L2
-    fprintf(stderr,"window %d sample %d haplotype %d - %4.2f", window->idx, wsample->sample_idx,
-	    h, wsample->est_p[h][0]);
-    for(int k=1; k < window->n_subpops; k++)
-      fprintf(stderr, ", %4.2f", wsample->est_p[h][k]);
-    fprintf(stderr,"\n");
-#endif
+  /* Add the sum of terminal node minimums to every subpop (see add_leaf_p()) */
+  int n_subpops = forest->n_subpops;
+  for(int j=w_start << 6; j < w_end << 6; j++) {
+    double *p = est_p[j];
+    if (p == NULL) continue;
+    for(int k=0; k < n_subpops; k++)
+      p[k] += p[n_subpops];
+    p[n_subpops] = 0.;
   }
 }
 
@@ -581,9 +1940,10 @@ static void setup_query_sample(wsample_t *wsample, sample_t *sample, int n_subpo
 			       int snp_start, int snp_end, int crf_snp,
 			       mm *ma) {
   int k, t, s;
+  int n_snps = snp_end - snp_start + 1;
 
   for(k=0; k < 4; k++)
-    wsample->haplotype[k] = (int *) ma->allocate(sizeof(int)*(snp_end - snp_start + 1), WHEREFROM);
+    wsample->haplotype[k] = (int *) ma->allocate(sizeof(int)*n_snps, WHEREFROM);
     
   /* Haplotypes 0 and 1 in wsample are phased as given in input->sample[i] */
   for(k=0; k < 2; k++) {
@@ -591,26 +1951,89 @@ static void setup_query_sample(wsample_t *wsample, sample_t *sample, int n_subpo
       wsample->haplotype[k][t] = sample->haplotype[k][s];
   }
 
-  /* Haplotypes 2 and 3 in wsample are flipped phase at the crf_window snp_idx */
+  /* Haplotypes 2 and 3 in wsample are flipped phase at the crf_window snp_idx, and
+     are spliced from the halves of haplotypes 0 and 1. On the forest they follow the
+     paths of haplotypes 0 and 1 until those reach a split at or past the flip SNP
+     (see setup_query_bits()) */
+  int flip = crf_snp - snp_start;
+  if (flip < 0) flip = 0;
+  if (flip > n_snps) flip = n_snps;
+  wsample->flip_snp = flip;
   for(k=0; k < 2; k++) {
-    for(s=snp_start,t=0; s < crf_snp; s++,t++)
-      wsample->haplotype[k+2][t] = sample->haplotype[k][s];
-
-    /* second half of window is reverse phase */
     int l = k == 0 ? 1 : 0;
-    for(s=crf_snp; s <= snp_end; s++,t++) 
-      wsample->haplotype[k+2][t] = sample->haplotype[l][s];
+    memcpy(wsample->haplotype[k+2], wsample->haplotype[k], sizeof(int)*flip);
+    memcpy(wsample->haplotype[k+2] + flip, wsample->haplotype[l] + flip, sizeof(int)*(n_snps - flip));
   }
   
   for(int j=0; j < 4; j++) {
     //    wsample->current_p[j] = (double *) ma->allocate(sizeof(double)*n_subpops, WHEREFROM);
-    for(k=0; k < n_subpops; k++) {
+    for(k=0; k <= n_subpops; k++) {
       wsample->est_p[j][k] = 0.0;
       //      wsample->current_p[j][k] = DF16(sample->current_p[j & 0x1][k]);
     }
   }
 }
 
+/* Identifies the unique haplotypes in the window among the reference haplotypes (see 
+   window_t). Haplotypes identical to an earlier one are pointed to its allele array. 
+   With soft labels, haplotypes only need identical alleles to be collapsed, as the 
+   trees sum current_p over all the draws of a unique haplotype in any case. With hard
+   labels, the unique haplotypes are then renumbered in order of label. */
+static void collapse_ref_haplotypes(window_t *w, mm *ma) {
+  int n_ref = w->n_ref_haplotypes;
+  ref_haplotype_t *rh = w->ref_haplotypes;
+
+  int size = 64;
+  while(size < n_ref*2) size <<= 1;
+  int *table = (int *) ma->allocate(sizeof(int)*size, WHEREFROM);
+  for(int i=0; i < size; i++) table[i] = -1;
+  
+  int n_unique = 0;
+  int *unique_rh = (int *) ma->allocate(sizeof(int)*(n_ref + 1), WHEREFROM);
+  for(int i=0; i < n_ref; i++) {
+    int label = w->hard_labels ? rh[i].label : -1;
+    uint64_t t = hash_haplotype(rh[i].haplotype, w->n_snps, label) & (size - 1);
+
+    for(;;) {
+      if (table[t] == -1) {
+	table[t] = n_unique;
+	unique_rh[n_unique] = i;
+	rh[i].unique = n_unique++;
+	break;
+      }
+
+      ref_haplotype_t *u = rh + unique_rh[table[t]];
+      if ((!w->hard_labels || u->label == rh[i].label) &&
+	  memcmp(u->haplotype, rh[i].haplotype, sizeof(int)*w->n_snps) == 0) {
+	rh[i].haplotype = u->haplotype;
+	rh[i].unique = u->unique;
+	break;
+      }
+      t = (t + 1) & (size - 1);
+    }
+  }
+  
+  int *order = (int *) ma->allocate(sizeof(int)*n_unique, WHEREFROM);
+  if (w->hard_labels) {
+    int start[w->n_subpops + 1];
+    for(int k=0; k <= w->n_subpops; k++) start[k] = 0;
+    for(int u=0; u < n_unique; u++) start[rh[unique_rh[u]].label + 1]++;
+    for(int k=0; k < w->n_subpops; k++) start[k+1] += start[k];
+    for(int u=0; u < n_unique; u++) order[u] = start[rh[unique_rh[u]].label]++;
+    for(int i=0; i < n_ref; i++) rh[i].unique = order[rh[i].unique];
+  } else {
+    for(int u=0; u < n_unique; u++) order[u] = u;
+  }
+  
+  w->unique_haplotypes = (int **) ma->allocate(sizeof(int *)*n_unique, WHEREFROM);
+  w->unique_labels = (int *) ma->allocate(sizeof(int)*n_unique, WHEREFROM);
+  for(int u=0; u < n_unique; u++) {
+    w->unique_haplotypes[order[u]] = rh[unique_rh[u]].haplotype;
+    w->unique_labels[order[u]] = rh[unique_rh[u]].label;
+  }
+  w->n_unique_haplotypes = n_unique;
+}
+
 static void setup_ref_haplotypes(window_t *w, input_t *input, int start_snp, int end_snp,
 				 mm *ma) {
   int i, k, h;
@@ -643,6 +2066,8 @@ static void setup_ref_haplotypes(window_t *w, input_t *input, int start_snp, int
     /* At this point, we the sample may be included if its haplotypes have strong
        enough estimates - we check that for the individual haplotype */
     for(h=0; h < 2; h++) {
+      /* Not of the ancestry analyzed in this window, see restrict_hierarchy_level() */
+      if (samples[i].msp[h][window_idx] == -1) continue;
 
       // unpack the haplotype's current_p and find the subpop with the max probability
       int max = 0;
@@ -664,11 +2089,13 @@ static void setup_ref_haplotypes(window_t *w, input_t *input, int start_snp, int
 	/* copy over the current_p that we already unpacked */
 	  for(int k=0; k < n_subpops; k++)
 	    rh[nrh].current_p[k] = p_tmp[k];
+	  rh[nrh].label = -1;
 	} else {
 	  double d = 0.1/(2. + em_iteration);
 	  for(int k=0; k < n_subpops; k++)
 	    rh[nrh].current_p[k] = d/(n_subpops-1);
 	  rh[nrh].current_p[ samples[i].msp[h][window_idx] ] = 1. - d;
+	  rh[nrh].label = samples[i].msp[h][window_idx];
 	}
 	rh[nrh].max_idx = max;
 	
@@ -679,6 +2106,11 @@ static void setup_ref_haplotypes(window_t *w, input_t *input, int start_snp, int
   }
 
   delete[] p_tmp;
+
+  /* See the else branch above for current_p with hard labels */
+  w->hard_labels = em_iteration <= 1;
+  w->p_label = 1. - 0.1/(2. + em_iteration);
+  w->p_other = 0.1/(2. + em_iteration)/(n_subpops-1);
   
   int **subpop_rh_list = (int **) ma->allocate(sizeof(int *)*n_subpops, WHEREFROM);
   int c[n_subpops];
@@ -695,128 +2127,706 @@ static void setup_ref_haplotypes(window_t *w, input_t *input, int start_snp, int
   w->n_ref_haplotypes = nrh;
   w->n_ref_haplotypes_by_subpop = n_by_subpop;
   w->ref_haplotype_list = subpop_rh_list;
+
+  collapse_ref_haplotypes(w, ma);
 }
 
 
-static void *random_forest_thread(void *targ) {
-  thread_args_t *args = (thread_args_t *) targ;
-  input_t *input = args->input;
+/* Counts the query samples of the random forest and allocates the window's query
+   sample structures. These fields will not change in length and can be reused for 
+   every window. The haplotypes themselves though may change with each window if the
+   rf window size is variable. Those are allocated in setup_window() */
+static void init_window(window_t *window, input_t *input) {
   int n_subpops = input->n_subpops;
-  window_t window;
   int i;
   
-  mm *ma = new mm(16, WHEREFROM);
-  
-  window.n_query_samples = 0;
+  window->n_query_samples = 0;
   for(i=0; i < input->n_samples; i++) {
     if (rfmix_opts.reanalyze_reference == 0 && input->samples[i].apriori_subpop >= 0) continue;
     if (em_iteration == -1 && input->samples[i].s_sample != 1) continue;
     if (em_iteration != -1 && input->samples[i].s_sample == 1) continue;
     
-    window.n_query_samples++;
+    window->n_query_samples++;
   }
 
-  /* This memory allocation will not need to be done and redone with every window.
-     These fields will not change in length and can be reused. The haplotypes 
-     themselves though may change with each window if the rf window size is 
-     variable. Those are allocated in the loop using mm->allocate() */
-  MA(window.query_samples, sizeof(wsample_t)*window.n_query_samples, wsample_t);
-  for(i=0; i < window.n_query_samples; i++) {
-    MA(window.query_samples[i].est_p[0], sizeof(double)*4*(n_subpops), double);
+  MA(window->query_samples, sizeof(wsample_t)*window->n_query_samples, wsample_t);
+  for(i=0; i < window->n_query_samples; i++) {
+    MA(window->query_samples[i].est_p[0], sizeof(double)*4*(n_subpops + 1), double);
     for(int j=1; j < 4; j++)
-      window.query_samples[i].est_p[j] = window.query_samples[i].est_p[j-1] + n_subpops;
+      window->query_samples[i].est_p[j] = window->query_samples[i].est_p[j-1] + n_subpops + 1;
   }
+}
+
+static void free_window(window_t *window) {
+  for(int i=0; i < window->n_query_samples; i++) 
+    free(window->query_samples[i].est_p[0]);
+  free(window->query_samples);
+}
+
+/* Sets up the query haplotypes of window_t object for window w, over the SNPs the
+   window_t object already spans. Called again for each other window of a forest
+   group (see setup_forest_groups()) */
+static void setup_window_queries(window_t *window, input_t *input, int w, mm *ma) {
+  crf_window_t *crf = input->crf_windows + w;
+  int start_snp = window->snps - input->snps;
+  int end_snp = start_snp + window->n_snps - 1;
   
-  /* args object is always locked at the loop start point or when loop exits */
-  pthread_mutex_lock(&args->lock);
-  for(;;) {
-    
-    /* Get the next chunk of windows to process and unlock the shared args object */
-    int start_window = args->next_window;
-    int end_window = start_window + RF_THREAD_WINDOW_CHUNK_SIZE;
-    if (end_window > input->n_windows) end_window = input->n_windows;
-    args->next_window = end_window;
-    pthread_mutex_unlock(&args->lock);
-
-    for(int w=start_window; w < end_window; w++) {
-      /* At the beginning of each window we can recycle all the memory that was allocated
-	 for the previous window's needs. This is done effectively in one step by the
-	 mm class. */
-      ma->recycle();
-
-      crf_window_t *crf = input->crf_windows + w;
-      
-    /* set up window_t object and decoded/unpacked information from the input_t object */
-      window.n_subpops = n_subpops;
-      window.idx = w;
-      window.rng_idx = 1;
-      window.n_snps = crf->rf_end_idx - crf->rf_start_idx + 1;
-      window.snps = input->snps + crf->rf_start_idx;
+  window->idx = w;
+  int q = 0;
+  for(int i=0; i < input->n_samples; i++) {
+    if (rfmix_opts.reanalyze_reference == 0 && input->samples[i].apriori_subpop >= 0) continue;
+    if (em_iteration == -1 && input->samples[i].s_sample != 1) continue;
+    if (em_iteration != -1 && input->samples[i].s_sample == 1) continue;
+	
+    window->query_samples[q].sample_idx = i;
+    for(int h=0; h < 4; h++)
+      window->query_samples[q].analyzed[h] = input->samples[i].msp[h][w] != -1;
+    setup_query_sample(window->query_samples + q, input->samples + i, window->n_subpops,
+		       start_snp, end_snp, crf->snp_idx, ma);
+    q++;
+  }
+  setup_query_bits(window, ma);
+}
+
+/* Sets up window_t object and decoded/unpacked information from the input_t object
+   for window w, with the random forest trained on SNPs start_snp to end_snp */
+static void setup_window(window_t *window, input_t *input, int w, int start_snp, int end_snp,
+			 mm *ma) {
+  window->n_subpops = input->n_subpops;
+  window->idx = w;
+  window->n_snps = end_snp - start_snp + 1;
+  window->snps = input->snps + start_snp;
 #ifdef DEBUG_L2
-      fprintf(stderr,"window %d  %d snps   %d to %d\n", window.idx, window.n_snps, crf->rf_start_idx,
-	      crf->rf_end_idx);
+  fprintf(stderr,"window %d  %d snps   %d to %d\n", window->idx, window->n_snps, start_snp, end_snp);
 #endif
-      int q = 0;
-      for(i=0; i < input->n_samples; i++) {
-	if (rfmix_opts.reanalyze_reference == 0 && input->samples[i].apriori_subpop >= 0) continue;
-	if (em_iteration == -1 && input->samples[i].s_sample != 1) continue;
-	if (em_iteration != -1 && input->samples[i].s_sample == 1) continue;
-	
-	window.query_samples[q].sample_idx = i;
-	setup_query_sample(window.query_samples + q, input->samples + i, n_subpops,
-			   crf->rf_start_idx, crf->rf_end_idx, crf->snp_idx, ma);
-	q++;
+  /* There is no reference panel with rfmix apply, and the split bits and SNPs are
+     only for growing trees */
+  if (rfmix_opts.command != RFMIX_APPLY) {
+    setup_ref_haplotypes(window, input, start_snp, end_snp, ma);
+    if (rfmix_opts.classifier == RF_CLASSIFIER_FOREST) {
+      setup_window_split_bits(window, ma);
+      setup_split_snps(window, ma);
+    }
+  }
+  setup_window_queries(window, input, w, ma);
+}
+
+/* Normalizes the window's est_p to probabilities that sum to one across all subpops,
+   and repacks them into input_t */
+static void store_window_results(window_t *window, input_t *input) {
+  int n_subpops = window->n_subpops;
+
+  /* Duplicate query haplotypes were not evaluated, see setup_query_bits() */
+  for(int d=0; d < window->n_query_duplicates; d++)
+    memcpy(window->query_duplicate_est_p[d], window->query_est_p[ window->query_duplicate_of[d] ],
+	   sizeof(double)*n_subpops);
+  
+  for(int i=0; i < window->n_query_samples; i++) {
+    wsample_t *wsample = window->query_samples + i;
+
+    for(int j=0; j < 4; j++) {
+      if (!wsample->analyzed[j]) continue;
+      normalize_vector(wsample->est_p[j], n_subpops);
+#ifdef DEBUG_L2
+      fprintf(stderr,"window %d sample %d haplotype %d - %4.2f", window->idx, wsample->sample_idx,
+	      j, wsample->est_p[j][0]);
+      for(int k=1; k < n_subpops; k++)
+	fprintf(stderr, ", %4.2f", wsample->est_p[j][k]);
+      fprintf(stderr,"\n");
+#endif
+      for(int k=0; k < n_subpops; k++) {
+	double p = wsample->est_p[j][k];
+	input->samples[wsample->sample_idx].est_p[j][ IDX(window->idx,k) ] = ef16(p);
       }
-      setup_ref_haplotypes(&window, input, crf->rf_start_idx, crf->rf_end_idx, ma);
+    }
+  }
+}
+
+/* The tree builders' scratch space, one for each worker of the thread pool. Their
+   build_ arrays are kept from one call of random_forest() to the next, and the rest
+   is allocated from the worker's arena for each window */
+static tree_builder_t *worker_builders = NULL;
+
+static void init_tree_builder(tree_builder_t *builder) {
+  builder->ma = NULL;
+  builder->build_q = NULL;
+  builder->build_q_size = 0;
+  builder->build_snp_id = NULL;
+  builder->build_offset = NULL;
+  builder->build_nodes_size = 0;
+  builder->build_m = NULL;
+  builder->build_m_size = 0;
+  builder->build_leaf_k = NULL;
+  builder->build_leaf_k_size = 0;
+  builder->build_leaf_p = NULL;
+  builder->build_leaf_p_size = 0;
+}
+
+static void free_tree_builder(tree_builder_t *builder) {
+  free(builder->build_q);
+  free(builder->build_snp_id);
+  free(builder->build_offset);
+  free(builder->build_m);
+  free(builder->build_leaf_k);
+  free(builder->build_leaf_p);
+}
+
+/* Allocates the builder's scratch space for a window, after the builder's memory has
+   been recycled for it. split_bits has room for node bits and up to 32 weight bit 
+   planes. */
+static void setup_tree_builder(tree_builder_t *builder, window_t *window) {
+  mm *ma = builder->ma;
+  int n_words = window->n_split_words;
+  
+  builder->split_bits = (uint64_t *) ma->allocate(sizeof(uint64_t)*33*(n_words + 1), WHEREFROM);
+  builder->build_snp_q = (int *) ma->allocate(sizeof(int)*(RF_MAX_TREE_LEVEL + 2)*window->n_snps, WHEREFROM);
+  builder->build_query_mask = NULL;
+  if (window->n_query_words > 0)
+    builder->build_query_mask = (uint64_t *) ma->allocate(sizeof(uint64_t)*(RF_MAX_TREE_LEVEL + 2)*window->n_query_words, WHEREFROM);
+}
 
-      /* Build trees */
-      tree_t **trees = (tree_t **) ma->allocate(sizeof(tree_t *)*rfmix_opts.n_trees, WHEREFROM);
-      for(i=0; i < rfmix_opts.n_trees; i++)
-	trees[i] = build_tree(input, &window, args->rng, ma);
+static void report_progress(thread_args_t *args, int n_complete) {
+  int windows_complete = __sync_add_and_fetch(&args->windows_complete, n_complete);
+  if (isatty(2))
+    fprintf(stderr, "\r%s -- (%d/%d) %5.1f%%   ",
+	    rfmix_opts.classifier == RF_CLASSIFIER_FOREST ? "Growing Random Forest Trees" : "Classifying Windows",
+	    windows_complete, args->input->n_windows, windows_complete / (double) args->input->n_windows * 100.);
+}
+
+/* Returns the next forest group for thread thread_idx to process, from its own deque
+   or else stolen from another thread's, or -1 when all groups are taken */
+static int next_group(thread_args_t *args, int thread_idx) {
+  window_deque_t *deque = args->deques + thread_idx;
+  int w = -1;
+
+  pthread_mutex_lock(&deque->lock);
+  if (deque->head < deque->tail)
+    w = deque->windows[deque->head++];
+  pthread_mutex_unlock(&deque->lock);
+
+  for(int i=1; w == -1 && i < rfmix_opts.n_threads; i++) {
+    deque = args->deques + (thread_idx + i) % rfmix_opts.n_threads;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->head < deque->tail)
+      w = deque->windows[--deque->tail];
+    pthread_mutex_unlock(&deque->lock);
+  }
+
+  return w;
+}
+
+typedef struct {
+  double cost;
+  int idx;
+} window_cost_t;
+
+static int cmp_window_cost(const void *a, const void *b) {
+  const window_cost_t *wa = (const window_cost_t *) a;
+  const window_cost_t *wb = (const window_cost_t *) b;
+  if (wa->cost != wb->cost) return wa->cost < wb->cost ? 1 : -1;
+  return wa->idx - wb->idx;
+}
+
+/* Whether the sample's haplotypes may be reference haplotypes in the current 
+   iteration (see setup_ref_haplotypes()) */
+static int may_be_ref_sample(sample_t *sample) {
+  if (em_iteration == -1 && sample->s_parent == 1) return 0;
+  if (sample->s_sample == 1) return 0;
+  if (em_iteration <= 0 && sample->apriori_subpop == -1) return 0;
+  return 1;
+}
+
+/* The number of reference haplotypes setup_ref_haplotypes() takes for window w, by 
+   the same test */
+static int count_ref_haplotypes(input_t *input, int w) {
+  int n_subpops = input->n_subpops;
+  int n_ref = 0;
+
+  for(int i=0; i < input->n_samples; i++) {
+    sample_t *sample = input->samples + i;
+    if (!may_be_ref_sample(sample)) continue;
+    
+    for(int h=0; h < 2; h++) {
+      if (sample->msp[h][w] == -1) continue;
+      double max = DF16(sample->current_p[h][ IDX(w,0) ]);
+      for(int k=1; k < n_subpops; k++) {
+	double p = DF16(sample->current_p[h][ IDX(w,k) ]);
+	if (p > max) max = p;
+      }
+      if (max > P_MINIMUM_FOR_REF) n_ref++;
+    }
+  }
+  return n_ref;
+}
+
+/* Deals the forest groups to the threads' deques in order of estimated cost, most
+   expensive first, so that the expensive groups are started first and cheap ones are
+   left at the end to balance the threads. The cost of building a tree is roughly in 
+   proportion to the number of SNPs times the number of reference haplotypes, counted
+   for the window each group's forest is trained for. Those differ between groups
+   once EM adds query haplotypes to the reference, and with --hierarchy. */
+static void setup_window_deques(thread_args_t *args) {
+  input_t *input = args->input;
+  int n_threads = rfmix_opts.n_threads;
+  int n_groups = args->n_groups;
+  window_cost_t *costs;
+
+  MA(costs, sizeof(window_cost_t)*n_groups, window_cost_t);
+  for(int g=0; g < n_groups; g++) {
+    int first = args->group_start[g];
+    int last = args->group_start[g+1] - 1;
+    int start_snp = input->crf_windows[first].rf_start_idx;
+    int end_snp = input->crf_windows[last].rf_end_idx;
+    int n_ref = count_ref_haplotypes(input, first + (last - first)/2);
+    costs[g].cost = (double) (end_snp - start_snp + 1) * n_ref * rfmix_opts.n_trees;
+    costs[g].idx = g;
+  }
+  qsort(costs, n_groups, sizeof(window_cost_t), cmp_window_cost);
+
+  MA(args->deques, sizeof(window_deque_t)*n_threads, window_deque_t);
+  for(int i=0; i < n_threads; i++) {
+    window_deque_t *deque = args->deques + i;
+    MA(deque->windows, sizeof(int)*(n_groups/n_threads + 1), int);
+    deque->head = 0;
+    deque->tail = 0;
+    pthread_mutex_init(&deque->lock, NULL);
+  }
+  for(int g=0; g < n_groups; g++) {
+    window_deque_t *deque = args->deques + g % n_threads;
+    deque->windows[deque->tail++] = costs[g].idx;
+  }
+  
+  free(costs);
+}
+
+/* Whether windows v and w have the same random forest training input, the same SNPs
+   and the same labels and probabilities of every haplotype that may be a reference
+   haplotype (see setup_ref_haplotypes()) */
+static int same_training_input(input_t *input, int v, int w) {
+  crf_window_t *a = input->crf_windows + v;
+  crf_window_t *b = input->crf_windows + w;
+  int n_subpops = input->n_subpops;
+
+  if (a->rf_start_idx != b->rf_start_idx || a->rf_end_idx != b->rf_end_idx) return 0;
+  
+  for(int i=0; i < input->n_samples; i++) {
+    sample_t *sample = input->samples + i;
+    if (!may_be_ref_sample(sample)) continue;
+    
+    for(int h=0; h < 2; h++) {
+      if (sample->msp[h][v] != sample->msp[h][w]) return 0;
+      for(int k=0; k < n_subpops; k++)
+	if (sample->current_p[h][ IDX(v,k) ] != sample->current_p[h][ IDX(w,k) ]) return 0;
+    }
+  }
+  return 1;
+}
+
+/* Groups consecutive windows that share one random forest, trained for the middle
+   window of the group on the SNPs of all of them. Windows with the same training 
+   input (often the case with genetic distance rf windows in sparse regions) get the
+   same forest they would have had on their own, but for the random numbers. With 
+   --rf-window-span=k, every k windows share a forest as an approximation. There are
+   no groups with --lazy-trees, as the trees only grow where the training window's 
+   query haplotypes go, nor with rfmix apply, which takes each window's forest from 
+   the model. */
+static void setup_forest_groups(thread_args_t *args) {
+  input_t *input = args->input;
+  int grouped = !rfmix_opts.lazy_trees && rfmix_opts.command != RFMIX_APPLY;
+  int span = rfmix_opts.rf_window_span;
+
+  MA(args->group_start, sizeof(int)*(input->n_windows + 1), int);
+  args->n_groups = 0;
+  for(int w=0; w < input->n_windows; w++) {
+    int first = args->n_groups > 0 ? args->group_start[args->n_groups - 1] : -1;
+    if (first == -1 || !grouped ||
+	(span > 1 ? w - first >= span : !same_training_input(input, first, w)))
+      args->group_start[args->n_groups++] = w;
+  }
+  args->group_start[args->n_groups] = input->n_windows;
+}
+
+static void free_window_deques(thread_args_t *args) {
+  for(int i=0; i < rfmix_opts.n_threads; i++) {
+    pthread_mutex_destroy(&args->deques[i].lock);
+    free(args->deques[i].windows);
+  }
+  free(args->deques);
+}
+
+/* With --rf-tolerance, a window's trees are built and evaluated RF_ADAPTIVE_BATCH_SIZE
+   at a time until the query haplotypes' estimates stop changing, otherwise all in 
+   one batch. Since trees are the same however many are built (see tree_t) and each
+   query haplotype is evaluated on the trees in order, a forest grown to the maximum
+   number of trees gives the same results either way. */
+static int tree_batch_size(void) {
+  return rfmix_opts.rf_tolerance > 0. ? RF_ADAPTIVE_BATCH_SIZE : rfmix_opts.n_trees;
+}
+
+/* Space for the query haplotypes' normalized est_p at the last batch of trees, NULL
+   if trees are not built in batches */
+static double *setup_last_p(window_t *window, mm *ma) {
+  int n = window->n_query_haplotypes*window->n_subpops;
+
+  if (rfmix_opts.rf_tolerance <= 0. || n == 0) return NULL;
+  double *last_p = (double *) ma->allocate(sizeof(double)*n, WHEREFROM);
+  for(int i=0; i < n; i++) last_p[i] = 0.;
+  return last_p;
+}
+
+/* Returns whether the window's forest of n_trees trees has converged, when the
+   largest change of any query haplotype's normalized est_p since the last batch is
+   below rfmix_opts.rf_tolerance and at least rfmix_opts.rf_min_trees are built. The
+   normalized est_p are kept in last_p for the next batch. */
+static int forest_converged(window_t *window, double *last_p, int n_trees) {
+  int n_subpops = window->n_subpops;
+  double max_change = 0.;
+
+  if (rfmix_opts.rf_tolerance <= 0.) return 0;
+  
+  for(int j=0; j < window->n_query_haplotypes; j++) {
+    double *est_p = window->query_est_p[j];
+    double sum = 0.;
+
+    if (est_p == NULL) continue;
+
+    for(int k=0; k < n_subpops; k++) sum += est_p[k];
+    for(int k=0; k < n_subpops; k++) {
+      double p = sum > 0. ? est_p[k] / sum : 0.;
+      double change = fabs(p - last_p[j*n_subpops + k]);
+      if (change > max_change) max_change = change;
+      last_p[j*n_subpops + k] = p;
+    }
+  }
+
+  return n_trees >= rfmix_opts.rf_min_trees && max_change < rfmix_opts.rf_tolerance;
+}
+
+/* Per window classifiers, selected with --classifier. train() learns from the 
+   reference haplotypes of the window set up by setup_window() for the middle window 
+   of forest group g, and fills query_est_p of that window's query haplotypes. 
+   evaluate() then fills query_est_p of the query haplotypes of each other window of
+   the group, set up in turn by setup_window_queries(), with the model train() 
+   returned. n_trees() is the number of trees of a model, 0 for classifiers other 
+   than the random forest. All of them are run by random_forest_thread() */
+typedef struct {
+  void *(*train)(thread_args_t *args, window_t *window, int g, int worker_idx, mm *ma);
+  void (*evaluate)(window_t *window, void *model);
+  int (*n_trees)(void *model);
+} classifier_t;
+
+/* The random forest, the default classifier. Trees are built and the window's query
+   haplotypes evaluated on them a batch at a time (see tree_batch_size()), and the 
+   model is the forest of all the trees. With rfmix train, the forest is kept in the
+   model file for every window of the group, and with rfmix apply it is taken from
+   the model instead of being built. */
+static void *train_forest(thread_args_t *args, window_t *window, int g, int worker_idx, mm *ma) {
+  input_t *input = args->input;
+  tree_builder_t *builder = worker_builders + worker_idx;
+  forest_t *forest;
+  int i;
+
+  if (rfmix_opts.command == RFMIX_APPLY) {
+    forest = args->model->forests[window->idx];
+    evaluate_forest(window, forest, 0, window->n_query_words);
+    return (void *) forest;
+  }
+  
+  builder->ma = ma;
+  setup_tree_builder(builder, window);
+  double *last_p = setup_last_p(window, ma);
+  int batch = tree_batch_size();
+
+  /* Build trees and evaluate them, a batch at a time */
+  tree_t **trees = (tree_t **) ma->allocate(sizeof(tree_t *)*rfmix_opts.n_trees, WHEREFROM);
+  int n_trees = 0;
+  do {
+    int end = n_trees + batch < rfmix_opts.n_trees ? n_trees + batch : rfmix_opts.n_trees;
+    for(i=n_trees; i < end; i++)
+      trees[i] = build_tree(input, window, builder, i, args->rng);
+
+    forest = compile_forest(trees + n_trees, end - n_trees, window->n_subpops, ma);
+    evaluate_forest(window, forest, 0, window->n_query_words);
+    n_trees = end;
+  } while(n_trees < rfmix_opts.n_trees && !forest_converged(window, last_p, n_trees));
 
 #if 0
-      pthread_mutex_lock(&args->lock);
-      for(i=0; i < rfmix_opts.n_trees; i++) 
-	output_tree(stdout, trees[i]);
-      pthread_mutex_unlock(&args->lock);
+  pthread_mutex_lock(&args->lock);
+  for(i=0; i < n_trees; i++) 
+    output_tree(stdout, trees[i]);
+  pthread_mutex_unlock(&args->lock);
 #endif
       
-      /* evaluate trees */
-      for(i=0; i < window.n_query_samples; i++)
-	evaluate_sample(window.query_samples + i, &window, trees, rfmix_opts.n_trees);
+  if (forest->n_trees < n_trees)
+    forest = compile_forest(trees, n_trees, window->n_subpops, ma);
+  if (args->model != NULL) {
+    for(int v=args->group_start[g]; v < args->group_start[g+1]; v++)
+      save_model_forest(args->model, v, forest);
+  }
+  return (void *) forest;
+}
 
-	/* Repack window_t object results into input_t and reset/reinitialize window_t 
-       for next window */
-      for(i=0; i < window.n_query_samples; i++) {
-	wsample_t *wsample = window.query_samples + i;
+static void evaluate_forest_model(window_t *window, void *model) {
+  evaluate_forest(window, (forest_t *) model, 0, window->n_query_words);
+}
 
-	for(int j=0; j < 4; j++) {
+static int forest_n_trees(void *model) {
+  return ((forest_t *) model)->n_trees;
+}
 
-	  for(int k=0; k < n_subpops; k++) {
-	    double p = wsample->est_p[j][k];
-	    input->samples[wsample->sample_idx].est_p[j][ IDX(w,k) ] = ef16(p);
-	  }
+/* Naive Bayes on the allele frequencies of each subpop in the window. log_f[] holds
+   the log frequency of each allele at each SNP for each subpop, at 
+   ((snp << 1) + allele)*n_subpops + subpop. Frequencies are counts of the reference
+   haplotypes by label, or with soft labels sums of their current_p, with half an 
+   allele of each added so none is zero */
+typedef struct {
+  double *log_f;
+} bayes_model_t;
+
+static void evaluate_bayes(window_t *window, void *m);
+
+static void *train_bayes(thread_args_t *args, window_t *window, int g, int worker_idx, mm *ma) {
+  int n_subpops = window->n_subpops;
+  int n_snps = window->n_snps;
+  int n = n_snps*n_subpops;
+  
+  bayes_model_t *model = (bayes_model_t *) ma->allocate(sizeof(bayes_model_t), WHEREFROM);
+  double *n1 = (double *) ma->allocate(sizeof(double)*n, WHEREFROM);
+  double *n_all = (double *) ma->allocate(sizeof(double)*n, WHEREFROM);
+  for(int i=0; i < n; i++) {
+    n1[i] = 0.;
+    n_all[i] = 0.;
+  }
+
+  for(int i=0; i < window->n_ref_haplotypes; i++) {
+    ref_haplotype_t *rh = window->ref_haplotypes + i;
+    int *haplotype = rh->haplotype;
+
+    if (window->hard_labels) {
+      for(int s=0; s < n_snps; s++) {
+	if (haplotype[s] == 2) continue;
+	n_all[s*n_subpops + rh->label] += 1.;
+	if (haplotype[s] == 1) n1[s*n_subpops + rh->label] += 1.;
+      }
+    } else {
+      for(int s=0; s < n_snps; s++) {
+	if (haplotype[s] == 2) continue;
+	for(int k=0; k < n_subpops; k++) {
+	  n_all[s*n_subpops + k] += rh->current_p[k];
+	  if (haplotype[s] == 1) n1[s*n_subpops + k] += rh->current_p[k];
 	}
       }
     }
-    
-    pthread_mutex_lock(&args->lock);
-    args->windows_complete += end_window - start_window;
-    if (isatty(2))
-      fprintf(stderr, "\rGrowing Random Forest Trees -- (%d/%d) %5.1f%%   ", args->windows_complete,
-	      input->n_windows, args->windows_complete / (double) input->n_windows * 100.);
+  }
+  
+  model->log_f = (double *) ma->allocate(sizeof(double)*2*n, WHEREFROM);
+  for(int s=0; s < n_snps; s++) {
+    for(int k=0; k < n_subpops; k++) {
+      int i = s*n_subpops + k;
+      model->log_f[((s << 1) + 0)*n_subpops + k] = log((n_all[i] - n1[i] + 0.5)/(n_all[i] + 1.));
+      model->log_f[((s << 1) + 1)*n_subpops + k] = log((n1[i] + 0.5)/(n_all[i] + 1.));
+    }
+  }
+  
+  evaluate_bayes(window, (void *) model);
+  return (void *) model;
+}
+
+static void evaluate_bayes(window_t *window, void *m) {
+  bayes_model_t *model = (bayes_model_t *) m;
+  int n_subpops = window->n_subpops;
+  int n_snps = window->n_snps;
+  double logl[n_subpops];
+
+  for(int j=0; j < window->n_query_haplotypes; j++) {
+    int *haplotype = window->query_haplotypes[j];
+    double *est_p = window->query_est_p[j];
+
+    if (haplotype == NULL) continue;
+    for(int k=0; k < n_subpops; k++) logl[k] = 0.;
+    for(int s=0; s < n_snps; s++) {
+      if (haplotype[s] == 2) continue;
+      double *log_f = model->log_f + ((s << 1) + haplotype[s])*n_subpops;
+      for(int k=0; k < n_subpops; k++) logl[k] += log_f[k];
+    }
 
-    if (args->next_window >= input->n_windows) break;
+    double max = logl[0];
+    for(int k=1; k < n_subpops; k++)
+      if (logl[k] > max) max = logl[k];
+    for(int k=0; k < n_subpops; k++)
+      est_p[k] = exp(logl[k] - max);
   }
+}
+
+static int bayes_n_trees(void *model) {
+  return 0;
+}
+
+static classifier_t classifiers[N_RF_CLASSIFIER] = {
+  { train_forest, evaluate_forest_model, forest_n_trees }, // RF_CLASSIFIER_FOREST
+  { train_bayes, evaluate_bayes, bayes_n_trees }
+};
+
+/* Takes forest groups of windows from the deques until none are left, and for each
+   trains the classifier of --classifier on the group's middle window and evaluates
+   every window of the group with it (see classifier_t) */
+static void random_forest_thread(void *targ, int worker_idx, mm *ma) {
+  thread_args_t *args = (thread_args_t *) targ;
+  input_t *input = args->input;
+  classifier_t *classifier = classifiers + rfmix_opts.classifier;
+  window_t window;
+  int g;
+
+  init_window(&window, input);
+  
+  while((g = next_group(args, worker_idx)) != -1) {
+    int first = args->group_start[g];
+    int last = args->group_start[g+1] - 1;
+    int w = first + (last - first)/2;
+    
+    /* At the beginning of each window we can recycle all the memory that was allocated
+       for the previous window's needs. This is done effectively in one step by the
+       mm class. */
+    ma->recycle();
+
+    setup_window(&window, input, w, input->crf_windows[first].rf_start_idx,
+		 input->crf_windows[last].rf_end_idx, ma);
+    void *model = classifier->train(args, &window, g, worker_idx, ma);
+    input->crf_windows[w].n_trees = classifier->n_trees(model);
+    store_window_results(&window, input);
+
+    for(int v=first; v <= last; v++) {
+      if (v == w) continue;
+      setup_window_queries(&window, input, v, ma);
+      classifier->evaluate(&window, model);
+      input->crf_windows[v].n_trees = classifier->n_trees(model);
+      store_window_results(&window, input);
+    }
+    report_progress(args, last - first + 1);
+  }
+
+  free_window(&window);
+}
+
+/* Gets the next task of a window's trees or query words shared by the threads of
+   random_forest_nested_thread(), n at a time of n_total. Returns the first, or -1
+   when there are none left */
+static int next_nested_task(thread_args_t *args, int n, int n_total) {
+  pthread_mutex_lock(&args->lock);
+  int task = args->next_task;
+  args->next_task += n;
   pthread_mutex_unlock(&args->lock);
+  return task < n_total ? task : -1;
+}
 
-  delete ma;
+/* When there are too few forest groups for every thread to have some, the threads
+   instead process the groups one at a time together. Thread 0 sets up each window, then
+   all threads build its trees, RF_NESTED_TREES_PER_TASK trees at a time, and then
+   evaluate the query haplotypes, RF_NESTED_WORDS_PER_TASK words of 64 at a time, 
+   for each batch of trees (see tree_batch_size()). Trees are built the same 
+   whichever thread builds them (see tree_t), and each query haplotype is still 
+   evaluated on the trees in order, so the results are the same as 
+   random_forest_thread(). */
+static void random_forest_nested_thread(void *targ, int worker_idx, mm *ma) {
+  thread_args_t *args = (thread_args_t *) targ;
+  input_t *input = args->input;
+  window_t *window = args->window;
+  tree_builder_t *builder = worker_builders + worker_idx;
+  int batch = tree_batch_size();
+  int t;
 
-  for(i=0; i < window.n_query_samples; i++) 
-    free(window.query_samples[i].est_p[0]);
-  free(window.query_samples);
+  builder->ma = ma;
   
-  return NULL;
+  for(int g=0; g < args->n_groups; g++) {
+    int first = args->group_start[g];
+    int last = args->group_start[g+1] - 1;
+    int w = first + (last - first)/2;
+    
+    if (worker_idx == 0) {
+      args->window_ma->recycle();
+      setup_window(window, input, w, input->crf_windows[first].rf_start_idx,
+		   input->crf_windows[last].rf_end_idx, args->window_ma);
+      args->last_p = setup_last_p(window, args->window_ma);
+      args->n_built = 0;
+      args->converged = 0;
+      args->next_task = 0;
+    }
+    pthread_barrier_wait(&args->barrier);
+    
+    /* The trees of the previous window are no longer needed once all threads have
+       passed the barrier above */
+    ma->recycle();
+    setup_tree_builder(builder, window);
+    
+    /* n_built and converged only change between the last two barriers of the loop */
+    while(args->n_built < rfmix_opts.n_trees && !args->converged) {
+      int end = args->n_built + batch < rfmix_opts.n_trees ? args->n_built + batch : rfmix_opts.n_trees;
+      while((t = next_nested_task(args, RF_NESTED_TREES_PER_TASK, end)) != -1) {
+	for(int i=t; i < t + RF_NESTED_TREES_PER_TASK && i < end; i++)
+	  args->trees[i] = build_tree(input, window, builder, i, args->rng);
+      }
+      pthread_barrier_wait(&args->barrier);
+
+      if (worker_idx == 0) {
+	args->forest = compile_forest(args->trees + args->n_built, end - args->n_built, window->n_subpops,
+				      args->window_ma);
+	args->next_task = 0;
+      }
+      pthread_barrier_wait(&args->barrier);
+
+      while((t = next_nested_task(args, RF_NESTED_WORDS_PER_TASK, window->n_query_words)) != -1) {
+	int w_end = t + RF_NESTED_WORDS_PER_TASK;
+	if (w_end > window->n_query_words) w_end = window->n_query_words;
+	evaluate_forest(window, args->forest, t, w_end);
+      }
+      pthread_barrier_wait(&args->barrier);
+
+      if (worker_idx == 0) {
+	args->n_built = end;
+	args->converged = end < rfmix_opts.n_trees && forest_converged(window, args->last_p, end);
+	args->next_task = end;
+      }
+      pthread_barrier_wait(&args->barrier);
+    }
+
+    if (worker_idx == 0) {
+      input->crf_windows[w].n_trees = args->n_built;
+      store_window_results(window, input);
+
+      /* The other windows of the group need all the trees in one forest */
+      if (args->forest->n_trees < args->n_built && first < last)
+	args->forest = compile_forest(args->trees, args->n_built, window->n_subpops, args->window_ma);
+      if (args->model != NULL) {
+	for(int v=first; v <= last; v++) save_model_forest(args->model, v, args->forest);
+      }
+    }
+    
+    for(int v=first; v <= last; v++) {
+      if (v == w) continue;
+      if (worker_idx == 0) {
+	setup_window_queries(window, input, v, args->window_ma);
+	args->next_task = 0;
+      }
+      pthread_barrier_wait(&args->barrier);
+
+      while((t = next_nested_task(args, RF_NESTED_WORDS_PER_TASK, window->n_query_words)) != -1) {
+	int w_end = t + RF_NESTED_WORDS_PER_TASK;
+	if (w_end > window->n_query_words) w_end = window->n_query_words;
+	evaluate_forest(window, args->forest, t, w_end);
+      }
+      pthread_barrier_wait(&args->barrier);
+
+      if (worker_idx == 0) {
+	input->crf_windows[v].n_trees = args->n_built;
+	store_window_results(window, input);
+      }
+    }
+    if (worker_idx == 0) report_progress(args, last - first + 1);
+
+    /* Thread 0 resets n_built and converged when it sets up the next window, so every
+       thread must be out of this window's loop first */
+    pthread_barrier_wait(&args->barrier);
+  }
 }
 
 static void __attribute__((unused))dump_results(input_t *input) {
@@ -837,7 +2847,7 @@ static void __attribute__((unused))dump_results(input_t *input) {
   }
 }
 
-void random_forest(input_t *input) {
+void random_forest(input_t *input, rf_model_t *model) {
   /* These are file scope variables used to ensure we do not underflow or overflow int8_t 
      floating point encoding when setting values into input->samples[].est_p[][ IDX(,) ]. These
      are the end result of this entire file's computations */
@@ -845,27 +2855,77 @@ void random_forest(input_t *input) {
   thread_args_t *args;
   MA(args, sizeof(thread_args_t), thread_args_t);
   args->input = input;
-  args->next_window = 0;
   args->windows_complete = 0;
-  args->rng = new md5rng(rfmix_opts.random_seed);
+  args->rng = new md5rng(rfmix_opts.random_seed, rfmix_opts.rng_engine);
+  args->model = model;
   
   pthread_mutex_init(&args->lock, NULL);
-  
-  pthread_t *threads;
-  MA(threads, sizeof(pthread_t)*rfmix_opts.n_threads, pthread_t);
 
-  for(int i=0; i < rfmix_opts.n_threads; i++)
-    pthread_create(threads + i, NULL, random_forest_thread, (void *) args);
+  count_bits = __builtin_cpu_supports("popcnt") ? count_bits_popcnt : count_bits_generic;
+  soft_sums = __builtin_cpu_supports("avx2") ? soft_sums_avx2 : soft_sums_generic;
+  
+  if (worker_builders == NULL) {
+    MA(worker_builders, sizeof(tree_builder_t)*rfmix_opts.n_threads, tree_builder_t);
+    for(int i=0; i < rfmix_opts.n_threads; i++)
+      init_tree_builder(worker_builders + i);
+  }
 
-  for(int i=0; i < rfmix_opts.n_threads; i++)
-    pthread_join(threads[i], NULL);
+  setup_forest_groups(args);
+  
+  /* With fewer than RF_NESTED_WINDOWS_PER_THREAD forest groups per thread, the threads
+     share the work of growing each group's random forest instead (see 
+     random_forest_nested_thread()) */
+  if (rfmix_opts.classifier == RF_CLASSIFIER_FOREST && rfmix_opts.command != RFMIX_APPLY &&
+      args->n_groups < rfmix_opts.n_threads*RF_NESTED_WINDOWS_PER_THREAD && rfmix_opts.n_threads > 1) {
+    MA(args->window, sizeof(window_t), window_t);
+    MA(args->trees, sizeof(tree_t *)*rfmix_opts.n_trees, tree_t *);
+    init_window(args->window, input);
+    args->window_ma = new mm(16, WHEREFROM);
+    pthread_barrier_init(&args->barrier, NULL, rfmix_opts.n_threads);
+    run_thread_pool(random_forest_nested_thread, (void *) args);
+
+    pthread_barrier_destroy(&args->barrier);
+    delete args->window_ma;
+    free_window(args->window);
+    free(args->window);
+    free(args->trees);
+  } else {
+    setup_window_deques(args);
+    run_thread_pool(random_forest_thread, (void *) args);
+    free_window_deques(args);
+  }
   fprintf(stderr,"\n");
 
+  if (args->n_groups < input->n_windows)
+    fprintf(stderr,"Random forests shared by windows: %d forests for %d windows\n", args->n_groups,
+	    input->n_windows);
+  if (rfmix_opts.rf_tolerance > 0.) {
+    int min = rfmix_opts.n_trees, max = 0;
+    double mean = 0.;
+    for(int w=0; w < input->n_windows; w++) {
+      int n = input->crf_windows[w].n_trees;
+      if (n < min) min = n;
+      if (n > max) max = n;
+      mean += n;
+    }
+    fprintf(stderr,"Random forest trees per window: mean %1.1f, min %d, max %d\n",
+	    mean / input->n_windows, min, max);
+  }
+
 #if 0
   dump_results(input);
 #endif
   
   delete args->rng;
-  free(threads);
+  pthread_mutex_destroy(&args->lock);
+  free(args->group_start);
   free(args);
 }
+
+void free_random_forest(void) {
+  if (worker_builders == NULL) return;
+  for(int i=0; i < rfmix_opts.n_threads; i++)
+    free_tree_builder(worker_builders + i);
+  free(worker_builders);
+  worker_builders = NULL;
+}
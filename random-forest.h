@@ -13,6 +13,46 @@
 #ifndef RANDOM_FOREST_H
 #define RANDOM_FOREST_H
 
-void random_forest(input_t *input);
+#include <stdint.h>
+
+/* Trees are never grown deeper than this, and the evaluation stacks are sized by it
+   (see also read_model()) */
+#define RF_MAX_TREE_LEVEL (20)
+
+/* All the trees of a window compiled into one node array for evaluating the query
+   haplotypes, see compile_forest(). Nodes are as in tree_t, with snp_id and offset
+   interleaved, and offsets, the terminal nodes' value offsets in snp_id too, are
+   into the forest's arrays. root[t] is the index of the root node of tree t. A 
+   forest may be read from a model file, see model.h 
+
+   Terminal node p vectors are sparse or dense as in tree_t, with n_leaf entries of
+   leaf_k and n_leaf_p values in all. With leaf_q NULL the values are leaf_p[], 
+   exactly as built, and otherwise they are quantized to 16 bits in leaf_q[], the 
+   value being leaf_q[i]*leaf_scale, with entries quantized to 0 left out of sparse
+   p vectors (see compile_forest()). */
+typedef struct {
+  int snp_id;
+  int offset;
+} forest_node_t;
+
+typedef struct {
+  int n_trees;
+  int n_subpops;
+  int n_nodes;
+  int n_terminal;
+  int n_leaf;
+  int n_leaf_p;
+  double leaf_scale;
+  int *root;
+  forest_node_t *nodes;
+  int *leaf_k;
+  double *leaf_p;
+  uint16_t *leaf_q;
+} forest_t;
+
+typedef struct rf_model rf_model_t;
+
+void random_forest(input_t *input, rf_model_t *model);
+void free_random_forest(void);
 
 #endif
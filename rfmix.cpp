@@ -28,6 +28,10 @@
 #include "gensamples.h"
 #include "load-input.h"
 #include "random-forest.h"
+#include "model.h"
+#include "thread-pool.h"
+#include "md5rng.h"
+#include "hierarchy.h"
 
 rfmix_opts_t rfmix_opts;
 int em_iteration;
@@ -40,12 +44,18 @@ static option_t options[] = {
     "VCF file with reference individuals                   (required)" },
   { 'm', "sample-map", &rfmix_opts.class_fname, OPT_STR, 1, 1,
     "Reference panel sample population classification map  (required)" },
+  { 0, "hierarchy", &rfmix_opts.hierarchy_fname, OPT_STR, 0, 1,
+    "Subpopulation hierarchy, lines of <subpop or group>\t<parent group>, analyzed\n"
+    "\tcoarse to fine (see manual)" },
   { 'g', "genetic-map", &rfmix_opts.genetic_fname, OPT_STR, 1, 1,
     "Genetic map file                                      (required)" },
   { 'o', "output-basename", &rfmix_opts.output_basename, OPT_STR, 1, 1,
     "Basename (prefix) for output files                    (required)" },
   { 0, "chromosome", &rfmix_opts.chromosome, OPT_STR, 1, 1,
-    "Execute only on specified chromosome                  (required)\n" },
+    "Execute only on specified chromosome                  (required)" },
+  { 0, "model", &rfmix_opts.model_fname, OPT_STR, 0, 1,
+    "Model file written by \"rfmix train\" or read by \"rfmix apply\"\n"
+    "\t(train needs only -r, -m, -g and --chromosome, apply needs only -f and -o)\n" },
 
   /* Tunable algorithm parameters (none are required - defaults are reasonable)*/
   { 'c', "crf-spacing", &rfmix_opts.crf_spacing, OPT_DBL, 0, 1,
@@ -63,12 +73,33 @@ static option_t options[] = {
 
   { 'n', "node-size", &rfmix_opts.node_size, OPT_INT, 0, 1,
     "Terminal node size for random forest trees" },
+  {  0, "rf-min-mac", &rfmix_opts.rf_min_mac, OPT_INT, 0, 1,
+     "Random forest trees do not split on SNPs whose minor allele is on fewer\n"
+     "\tthan this many reference haplotypes in the window" },
+  {  0, "rf-collapse-ld", &rfmix_opts.rf_collapse_ld, OPT_FLAG, 0, 0,
+     "Random forest trees only split on one of SNPs in perfect LD in the reference" },
   { 't', "trees", &rfmix_opts.n_trees, OPT_INT, 0, 1,
     "Number of tree in random forest to estimate population class probability" },
+  {  0, "rf-tolerance", &rfmix_opts.rf_tolerance, OPT_DBL, 0, 1,
+     "Stop growing a window's random forest when no query probability changes by\n"
+     "\tmore than this over a batch of trees (0 grows all -t trees)" },
+  {  0, "rf-min-trees", &rfmix_opts.rf_min_trees, OPT_INT, 0, 1,
+     "With --rf-tolerance, grow at least this many trees in each window" },
+  {  0, "rf-window-span", &rfmix_opts.rf_window_span, OPT_INT, 0, 1,
+     "Approximate by training one random forest for every this many CRF windows\n"
+     "\ton the SNPs of all of them" },
   {  0, "max-missing", &rfmix_opts.maximum_missing_data_freq, OPT_DBL, 0, 1,
       "Maximum proportion of missing data allowed to include a SNP" },
   { 'b', "bootstrap-mode", &rfmix_opts.bootstrap_mode, OPT_INT, 0, 1,
     "Specify random forest bootstrap mode as integer code (see manual)" },
+  { 0, "rf-sample-fraction", &rfmix_opts.rf_sample_fraction, OPT_DBL, 0, 1,
+    "Below 1, train each tree on this fraction of each subpop's reference haplotypes,\n"
+    "\tdrawn without replacement, instead of a bootstrap (-b)" },
+  { 0, "classifier", &rfmix_opts.classifier_str, OPT_STR, 0, 1,
+    "Per window classifier, \"forest\" (default) or \"bayes\", a much faster naive Bayes\n"
+    "\ton the subpops' allele frequencies for screening" },
+  { 0, "rf-quantize-leaves", &rfmix_opts.rf_quantize_leaves, OPT_FLAG, 0, 0,
+    "Store forest terminal node probabilities in 16 bits, dropping the smallest" },
   { 0, "rf-minimum-snps", &rfmix_opts.minimum_snps, OPT_INT, 0, 1,
     "With genetic sized rf windows, include at least this many SNPs regardless of span" },
   { 0, "analyze-range", &rfmix_opts.analyze_str, OPT_STR, 0, 1,
@@ -79,18 +110,28 @@ static option_t options[] = {
     "Turn on any debugging output" },
   { 0, "n-threads", &rfmix_opts.n_threads, OPT_INT, 0, 1,
     "Force number of simultaneous thread for parallel execution" },
+  { 0, "pin-threads", &rfmix_opts.pin_threads, OPT_FLAG, 0, 0,
+    "Pin each thread to its own cpu" },
+  { 0, "lazy-trees", &rfmix_opts.lazy_trees, OPT_FLAG, 0, 0,
+    "Only grow the parts of random forest trees that query haplotypes reach" },
   { 0, "random-seed", &rfmix_opts.random_seed_str, OPT_STR, 0, 1,
     "Seed value for random number generation (integer)\n"
     "\t(maybe specified in hexadecimal by preceeding with 0x), or the string\n"
     "\t\"clock\" to seed with the current system time." },
+  { 0, "rng", &rfmix_opts.rng_str, OPT_STR, 0, 1,
+    "Random number engine, \"md5\" (default) or \"splitmix\", a faster engine with which\n"
+    "\ttree nodes also only draw the SNPs they evaluate. Results differ by engine" },
   { 0, NULL, NULL, 0, 0, 0, NULL }
 };
 
 static void init_options(void) {
+  rfmix_opts.command = RFMIX_RUN;
+  rfmix_opts.model_fname = (char *) "";
   rfmix_opts.qvcf_fname = (char *) "";
   rfmix_opts.rvcf_fname = (char *) "";
   rfmix_opts.genetic_fname = (char *) "";
   rfmix_opts.class_fname = (char *) "";
+  rfmix_opts.hierarchy_fname = (char *) "";
   rfmix_opts.output_basename = (char *) "";
 
   rfmix_opts.maximum_missing_data_freq = 0.05;
@@ -98,8 +139,16 @@ static void init_options(void) {
   rfmix_opts.crf_spacing = 5;
   rfmix_opts.n_generations = 8;
   rfmix_opts.n_trees = 100;
+  rfmix_opts.rf_tolerance = 0.;
+  rfmix_opts.rf_min_trees = 20;
+  rfmix_opts.rf_window_span = 1;
+  rfmix_opts.rf_min_mac = 0;
+  rfmix_opts.rf_collapse_ld = 0;
   rfmix_opts.node_size = 2;
   rfmix_opts.bootstrap_mode = 1;
+  rfmix_opts.rf_sample_fraction = 1.;
+  rfmix_opts.rf_quantize_leaves = 0;
+  rfmix_opts.classifier_str = (char *) "forest";
   rfmix_opts.em_iterations = 0;
   rfmix_opts.minimum_snps = 10;
   rfmix_opts.analyze_str = (char *) "";
@@ -110,8 +159,11 @@ static void init_options(void) {
   
   rfmix_opts.debug = 0;
   rfmix_opts.n_threads = sysconf(_SC_NPROCESSORS_CONF);
+  rfmix_opts.pin_threads = 0;
+  rfmix_opts.lazy_trees = 0;
   rfmix_opts.chromosome = (char *) "";
   rfmix_opts.random_seed_str = (char *) "0xDEADBEEF";
+  rfmix_opts.rng_str = (char *) "md5";
 }
 
 static void print_banner(void) {
@@ -135,31 +187,71 @@ static void print_banner(void) {
 static void verify_options(void) {
   int stop = 0;
   
-  if (strcmp(rfmix_opts.qvcf_fname,"") == 0) {
+  int command = rfmix_opts.command;
+  
+  /* rfmix train needs only the reference panel, and rfmix apply gets everything but
+     the query samples from the model */
+  if (command != RFMIX_TRAIN && strcmp(rfmix_opts.qvcf_fname,"") == 0) {
     fprintf(stderr,"\nSpecify query/admixed VCF input file with -f option");
     stop = 1;
   }
-  if (strcmp(rfmix_opts.rvcf_fname,"") == 0) {
+  if (command != RFMIX_APPLY && strcmp(rfmix_opts.rvcf_fname,"") == 0) {
     fprintf(stderr,"\nSpecify reference VCF input file with -r option");
     stop = 1;
   }
-  if (strcmp(rfmix_opts.qvcf_fname, rfmix_opts.rvcf_fname) == 0) {
+  if (command == RFMIX_RUN && strcmp(rfmix_opts.qvcf_fname, rfmix_opts.rvcf_fname) == 0) {
     fprintf(stderr,"\nQuery and reference may not be the same file");
     stop = 1;
   }
   
-  if (strcmp(rfmix_opts.genetic_fname,"") == 0) {
+  if (command != RFMIX_APPLY && strcmp(rfmix_opts.genetic_fname,"") == 0) {
     fprintf(stderr,"\nSpecify genetic map file with -g option");
     stop = 1;
   }
-  if (strcmp(rfmix_opts.class_fname,"") == 0) {
+  if (command != RFMIX_APPLY && strcmp(rfmix_opts.class_fname,"") == 0) {
     fprintf(stderr,"\nSpecify reference sample subpopulation mapping with -m option");
     stop = 1;
   }
-  if (strcmp(rfmix_opts.output_basename,"") == 0) {
+  if (command != RFMIX_TRAIN && strcmp(rfmix_opts.output_basename,"") == 0) {
     fprintf(stderr,"\nSpecify output files basename (prefix) with -o option");
     stop = 1;
   }
+  if (command != RFMIX_RUN && strcmp(rfmix_opts.model_fname,"") == 0) {
+    fprintf(stderr,"\nSpecify the model file with --model option");
+    stop = 1;
+  }
+  if (command == RFMIX_TRAIN && rfmix_opts.lazy_trees) {
+    fprintf(stderr,"\n--lazy-trees grows trees only for the query samples, and can not be used with rfmix train");
+    stop = 1;
+  }
+  if (command != RFMIX_RUN && rfmix_opts.rf_tolerance > 0.) {
+    fprintf(stderr,"\n--rf-tolerance sizes forests by their query results, and can not be used with rfmix train or apply");
+    stop = 1;
+  }
+  if (command != RFMIX_RUN && rfmix_opts.rf_window_span > 1) {
+    fprintf(stderr,"\n--rf-window-span trains forests on the SNPs of several windows, and can not be used with rfmix train or apply");
+    stop = 1;
+  }
+  if (rfmix_opts.lazy_trees && rfmix_opts.rf_window_span > 1) {
+    fprintf(stderr,"\n--lazy-trees only grows trees for one window's queries, and can not be used with --rf-window-span");
+    stop = 1;
+  }
+  if (command == RFMIX_APPLY && rfmix_opts.rf_quantize_leaves) {
+    fprintf(stderr,"\nrfmix apply uses the forests as stored in the model, give --rf-quantize-leaves to rfmix train");
+    stop = 1;
+  }
+  if (command != RFMIX_RUN && strcmp(rfmix_opts.hierarchy_fname,"") != 0) {
+    fprintf(stderr,"\n--hierarchy trains a forest for each group of the hierarchy, and can not be used with rfmix train or apply");
+    stop = 1;
+  }
+  if (strcmp(rfmix_opts.hierarchy_fname,"") != 0 && rfmix_opts.reanalyze_reference) {
+    fprintf(stderr,"\n--hierarchy only analyzes the query samples, and can not be used with --reanalyze-reference");
+    stop = 1;
+  }
+  if (command == RFMIX_APPLY && (rfmix_opts.em_iterations > 0 || rfmix_opts.reanalyze_reference)) {
+    fprintf(stderr,"\nEM and reanalyzing the reference need the reference panel, and can not be used with rfmix apply");
+    stop = 1;
+  }
 
   if (rfmix_opts.maximum_missing_data_freq < 0.0 || rfmix_opts.maximum_missing_data_freq > 1.0) {
     fprintf(stderr,"\nRange for --max-missing option is 0.0 to 1.0");
@@ -183,6 +275,22 @@ static void verify_options(void) {
     fprintf(stderr,"\nNumber of random forest trees must be at least 10");
     stop = 1;
   }
+  if (rfmix_opts.rf_tolerance < 0.) {
+    fprintf(stderr,"\nRandom forest tolerance (--rf-tolerance) must not be negative");
+    stop = 1;
+  }
+  if (rfmix_opts.rf_min_trees < 1 || rfmix_opts.rf_min_trees > rfmix_opts.n_trees) {
+    fprintf(stderr,"\nMinimum number of random forest trees (--rf-min-trees) must be from 1 to -t");
+    stop = 1;
+  }
+  if (rfmix_opts.rf_window_span < 1) {
+    fprintf(stderr,"\nRandom forest window span (--rf-window-span) must be at least 1");
+    stop = 1;
+  }
+  if (rfmix_opts.rf_min_mac < 0) {
+    fprintf(stderr,"\nMinimum minor allele count (--rf-min-mac) must not be negative");
+    stop = 1;
+  }
   if (rfmix_opts.node_size < 2) {
     fprintf(stderr,"\nRandom forest node size must be at least 2");
     stop = 1;
@@ -191,6 +299,10 @@ static void verify_options(void) {
     fprintf(stderr,"\nBootstrap mode (-b) out of valid range - see manual");
     stop = 1;
   }
+  if (rfmix_opts.rf_sample_fraction <= 0. || rfmix_opts.rf_sample_fraction > 1.) {
+    fprintf(stderr,"\nRange for --rf-sample-fraction option is above 0.0 to 1.0");
+    stop = 1;
+  }
   if (strcmp(rfmix_opts.analyze_str, "") != 0) {
     char *p, *start, *end;
     end = p = strdup(rfmix_opts.analyze_str);
@@ -208,7 +320,7 @@ static void verify_options(void) {
   }
   
   if (rfmix_opts.n_threads < 1) rfmix_opts.n_threads = 1;
-  if (strcmp(rfmix_opts.chromosome,"") == 0) {
+  if (command != RFMIX_APPLY && strcmp(rfmix_opts.chromosome,"") == 0) {
     fprintf(stderr,"\nSpecify VCF chromosome to analyze with -c option");
     stop = 1;
   }
@@ -222,6 +334,34 @@ static void verify_options(void) {
      used, usually temporary hacks/tests/debugging. Otherwise md5rng is used 
      for repeatability even when multiple threads are used */
   srand(rfmix_opts.random_seed);
+
+  if (strcmp(rfmix_opts.rng_str, "md5") == 0) {
+    rfmix_opts.rng_engine = MD5RNG_MD5;
+  } else if (strcmp(rfmix_opts.rng_str, "splitmix") == 0) {
+    rfmix_opts.rng_engine = MD5RNG_SPLITMIX;
+  } else {
+    fprintf(stderr,"\nRandom number engine (--rng) must be md5 or splitmix");
+    stop = 1;
+  }
+  
+  if (strcmp(rfmix_opts.classifier_str, "forest") == 0) {
+    rfmix_opts.classifier = RF_CLASSIFIER_FOREST;
+  } else if (strcmp(rfmix_opts.classifier_str, "bayes") == 0) {
+    rfmix_opts.classifier = RF_CLASSIFIER_BAYES;
+  } else {
+    fprintf(stderr,"\nClassifier (--classifier) must be forest or bayes");
+    stop = 1;
+  }
+  if (command != RFMIX_RUN && rfmix_opts.classifier != RF_CLASSIFIER_FOREST) {
+    fprintf(stderr,"\nModel files hold random forests, --classifier=%s can not be used with rfmix train or apply",
+	    rfmix_opts.classifier_str);
+    stop = 1;
+  }
+  if (rfmix_opts.classifier != RF_CLASSIFIER_FOREST && rfmix_opts.rf_tolerance > 0.) {
+    fprintf(stderr,"\n--rf-tolerance sizes random forests, and can not be used with --classifier=%s",
+	    rfmix_opts.classifier_str);
+    stop = 1;
+  }
   
   if (stop != 0) {
     fprintf(stderr,"\n\nCorrect command line errors to run rfmix. Run program with no options for help\n");
@@ -230,24 +370,30 @@ static void verify_options(void) {
 }
 
 
-static double do_iteration(input_t *input, double crf_weight, double last_logl) {
+static void write_output(input_t *input) {
+  fprintf(stderr,"\n");
+  msp_output(input);
+  fb_output(input);
+  fb_stay_in_state_output(input);
+  if (rfmix_opts.rf_tolerance > 0.) rf_trees_output(input);
+  output_Q(input);
+}
+
+static double do_iteration(input_t *input, rf_model_t *model, double crf_weight, double last_logl,
+			   hierarchy_level_t *level) {
 
   fprintf(stderr,"\n");
-  random_forest(input);
+  random_forest(input, model);
   double logl = crf(input, crf_weight);
 
   /* No output if em_iteration == -1 and we are in the internal simulation
      phase. Otherwise, update the output every EM iteration. If the user
      stops the program with CTRL-c after the initial analysis (em_iteration == 0),
      the output for the previous EM iteration will be available, as long as
-     the program is not stopped while it is outputting. */
-  if (em_iteration >= 0) {
-    fprintf(stderr,"\n");
-    msp_output(input);
-    fb_output(input);
-    fb_stay_in_state_output(input);
-    output_Q(input);
-  }
+     the program is not stopped while it is outputting. A hierarchy group's
+     analysis is only output once combined with all the others. */
+  if (level == NULL && em_iteration >= 0)
+    write_output(input);
   if (em_iteration > 0) {
     fprintf(stderr,"\n");
     fprintf(stderr,"EM iteration %d/%d - logl = %1.1f (%+1.1f)\n", em_iteration,
@@ -257,13 +403,40 @@ static double do_iteration(input_t *input, double crf_weight, double last_logl)
   return logl;
 }
 
+/* The initial analysis and EM iterations, of the loaded input or of one hierarchy group */
+static void run_em(input_t *input, rf_model_t *model, double crf_weight,
+		   hierarchy_level_t *level) {
+  double logl, last_logl;
+
+  /* at em_iteration 0 and above, simulation samples are ignored and the 
+     simulation parents are returned to the reference */
+  em_iteration = 0;
+  logl = do_iteration(input, model, crf_weight, 0, level);
+  fprintf(stderr,"Initial analysis - logl %1.1f\n", logl);
+
+  /* at em_iteration 1 and above, query samples with their present ancestry
+     estimates from the crf are added to the reference and then reanalyzed.
+     If --analyze-reference was specified, reference samples are also analyzed
+     and their local ancestry refined */
+  for(int i=0; i < rfmix_opts.em_iterations; i++) {
+    em_iteration = i + 1;
+    last_logl = logl;
+
+    logl = do_iteration(input, model, crf_weight, last_logl, level);
+    if (i > 0 && logl - last_logl < 0.1) {
+      fprintf(stderr,"EM converges at iteration %d\n", em_iteration);
+      break;
+    }
+  }
+}
+
 static double find_optimal_crf_weight(input_t *input) {
 
   fprintf(stderr,"Generating internal simulation samples...    ");
   generate_simulated_samples(input);
 
   em_iteration = -1;
-  random_forest(input);
+  random_forest(input, NULL);
 
   fprintf(stderr,"Scanning for optimal CRF Weight.... \n");
 
@@ -309,47 +482,126 @@ static double find_optimal_crf_weight(input_t *input) {
   return max_w;
 }
 
+/* rfmix train - trains the random forests of every window on the reference panel and
+   writes them to the model file, with the CRF weight found by the internal simulation
+   unless one was given */
+static void train_model(input_t *input) {
+  double crf_weight;
+  
+  em_iteration = -1;
+  crf_weight = rfmix_opts.crf_weight;
+  if (rfmix_opts.crf_weight <= 0)
+    crf_weight = find_optimal_crf_weight(input);
+
+  em_iteration = 0;
+  rf_model_t *model = new_model(input->n_windows, rfmix_opts.n_trees, input->n_subpops);
+  model->crf_weight = crf_weight;
+  
+  fprintf(stderr,"\n");
+  random_forest(input, model);
+  
+  fprintf(stderr,"Writing model to %s ... ", rfmix_opts.model_fname);
+  write_model(model, input, rfmix_opts.model_fname);
+  fprintf(stderr,"done\n");
+  
+  free_model(model);
+}
+
+/* rfmix --hierarchy - analyzes each group of the hierarchy in turn, top down, and
+   outputs the combined results once (see hierarchy.cpp). The CRF weight is found, if
+   not given, for the first group analyzed and used for all of them. */
+static void hierarchical_analysis(input_t *input, hierarchy_t *hier) {
+  double crf_weight = rfmix_opts.crf_weight;
+  
+  init_hierarchy_estimates(hier, input);
+  for(int l=0; l < hier->n_levels; l++) {
+    hierarchy_level_t *level = new_hierarchy_level(hier, input, hier->levels[l]);
+    
+    fprintf(stderr,"\nHierarchy group %s: %d subpops, %d query samples\n", hier->names[level->node],
+	    level->input->n_subpops, level->n_queries);
+    if (level->n_queries > 0) {
+      if (crf_weight <= 0) {
+	em_iteration = -1;
+	crf_weight = find_optimal_crf_weight(level->input);
+      }
+      run_em(level->input, NULL, crf_weight, level);
+    }
+    
+    combine_hierarchy_level(hier, input, level);
+    free_hierarchy_level(level);
+  }
+  finish_hierarchy_estimates(hier, input);
+
+  write_output(input);
+}
+
 int main(int argc, char *argv[]) {
-  double logl, last_logl, crf_weight;
+  double crf_weight;
+  rf_model_t *model = NULL;
   
   print_banner();
   init_options();
+  if (argc > 1 && strcmp(argv[1], "train") == 0) rfmix_opts.command = RFMIX_TRAIN;
+  if (argc > 1 && strcmp(argv[1], "apply") == 0) rfmix_opts.command = RFMIX_APPLY;
   cmdline_getoptions(options, argc, argv);
   verify_options();
+  init_thread_pool(rfmix_opts.n_threads, rfmix_opts.pin_threads);
+
+  /* The model gives the chromosome, the SNPs and windows, the subpops and the 
+     trees, so rfmix apply loads only the query samples */
+  if (rfmix_opts.command == RFMIX_APPLY) {
+    fprintf(stderr,"Reading model %s ... ", rfmix_opts.model_fname);
+    model = read_model(rfmix_opts.model_fname);
+    fprintf(stderr,"%d windows of %d trees\n", model->n_windows, model->n_trees);
+    
+    if (strcmp(rfmix_opts.chromosome, "") == 0) {
+      rfmix_opts.chromosome = model_chromosome(model);
+    } else if (strcmp(rfmix_opts.chromosome, model_chromosome(model)) != 0) {
+      fprintf(stderr,"Model %s is for chromosome %s, not %s\n", rfmix_opts.model_fname,
+	      model_chromosome(model), rfmix_opts.chromosome);
+      exit(-1);
+    }
+    rfmix_opts.n_trees = model->n_trees;
+  }
 
   fprintf(stderr,"\n");
-  input_t *rfmix_input = load_input();
+  input_t *rfmix_input = load_input(model);
   fprintf(stderr,"\n");
 
+  if (rfmix_opts.command == RFMIX_TRAIN) {
+    train_model(rfmix_input);
+    free_random_forest();
+    free_thread_pool();
+    free_input(rfmix_input);
+    return 0;
+  }
+
+  if (strcmp(rfmix_opts.hierarchy_fname, "") != 0) {
+    hierarchy_t *hier = read_hierarchy(rfmix_opts.hierarchy_fname, rfmix_input);
+    hierarchical_analysis(rfmix_input, hier);
+    free_hierarchy(hier);
+    free_random_forest();
+    free_thread_pool();
+    free_input(rfmix_input);
+    return 0;
+  }
+
   /* em_iteration at -1 tells random forest to hold out the simulation parents
      from the reference and crf to only analyze the simulation samples. This is
-     skipped if a weight parameter was set on the command line */
+     skipped if a weight parameter was set on the command line, or the model has
+     the weight found when it was trained */
   em_iteration = -1;
   crf_weight = rfmix_opts.crf_weight;
-  if (rfmix_opts.crf_weight <= 0)
+  if (rfmix_opts.crf_weight <= 0 && model != NULL)
+    crf_weight = model->crf_weight;
+  else if (rfmix_opts.crf_weight <= 0)
     crf_weight = find_optimal_crf_weight(rfmix_input);
   
-  /* at em_iteration 0 and above, simulation samples are ignored and the 
-     simulation parents are returned to the reference */
-  em_iteration = 0;
-  logl = do_iteration(rfmix_input, crf_weight, 0);
-  fprintf(stderr,"Initial analysis - logl %1.1f\n", logl);
-
-  /* at em_iteration 1 and above, query samples with their present ancestry
-     estimates from the crf are added to the reference and then reanalyzed.
-     If --analyze-reference was specified, reference samples are also analyzed
-     and their local ancestry refined */
-  for(int i=0; i < rfmix_opts.em_iterations; i++) {
-    em_iteration = i + 1;
-    last_logl = logl;
-
-    logl = do_iteration(rfmix_input, crf_weight, last_logl);
-    if (i > 0 && logl - last_logl < 0.1) {
-      fprintf(stderr,"EM converges at iteration %d\n", em_iteration);
-      break;
-    }
-  }
+  run_em(rfmix_input, model, crf_weight, NULL);
    
+  free_random_forest();
+  free_thread_pool();
   free_input(rfmix_input);
+  if (model != NULL) free_model(model);
   return 0;
 }
@@ -70,11 +70,19 @@ static inline int16_t ef16(double p) {
 /* Program command line and configuration options - see rfmix.c for option definitions
    and default values set in init_options(). The global variable rfmix_opts, declared 
    and set in rfmix.c is referenced all over the program for these values where needed */
+/* rfmix is run as "rfmix <options>" to analyze query samples against a reference
+   panel, "rfmix train <options>" to write the reference panel's random forests to
+   a model file, or "rfmix apply <options>" to analyze query samples with a model */
+enum { RFMIX_RUN=0, RFMIX_TRAIN, RFMIX_APPLY };
+
 typedef struct {
+  int command;
+  char *model_fname;
   char *qvcf_fname;
   char *rvcf_fname;
   char *genetic_fname;
   char *class_fname;
+  char *hierarchy_fname;
   char *output_basename;
 
   double maximum_missing_data_freq;
@@ -82,6 +90,13 @@ typedef struct {
   double rf_window_size;
   double crf_spacing;
   int n_trees;
+  double rf_tolerance;
+  int rf_min_trees;
+  int rf_window_span;
+  int rf_min_mac;
+  int rf_collapse_ld;
+  double rf_sample_fraction;
+  int rf_quantize_leaves;
   int node_size;
   int reanalyze_reference;
   int em_iterations;
@@ -93,9 +108,15 @@ typedef struct {
 
   int debug;
   int n_threads;
+  int pin_threads;
+  int lazy_trees;
   char *chromosome;
   char *random_seed_str;
   int random_seed;  /* set by parsing random_seed_str which might be "clock" or a hex number */
+  char *rng_str;
+  int rng_engine;   /* MD5RNG_MD5 or MD5RNG_SPLITMIX, set by parsing rng_str */
+  char *classifier_str;
+  int classifier;   /* RF_CLASSIFIER_*, set by parsing classifier_str */
 } rfmix_opts_t;
 
 /* I am using AF_TYPE to mean either float or double, depending on how set here, so
@@ -109,12 +130,14 @@ typedef struct {
    which the conditional random field is defined. For training the random forests estimating
    the probabilities at each CRF point/window, the SNPs used may come from a larger region 
    overlapping more than one CRF window. rf_start_idx and rf_end_idx indicate the first and
-   last SNP (inclusive) to be included in training the random forest */
+   last SNP (inclusive) to be included in training the random forest. n_trees is the
+   number of trees the random forest grew for the window (see --rf-tolerance) */
 typedef struct {
   int snp_idx;
   int rf_start_idx;
   int rf_end_idx;
   double genetic_pos;
+  int n_trees;
 } crf_window_t;
 
 typedef struct {
@@ -177,10 +200,14 @@ typedef struct {
 /* This can be anything. The value I put here I pulled out of my backside. */
 #define RFOREST_RNG_KEY 0x949FC1AD
 enum { RF_BOOTSTRAP_FLAT=0, RF_BOOTSTRAP_HIERARCHICAL, RF_BOOTSTRAP_STRATIFIED, N_RF_BOOTSTRAP };
+enum { RF_CLASSIFIER_FOREST=0, RF_CLASSIFIER_BAYES, N_RF_CLASSIFIER };
 
 #define MINIMUM_GENETIC_DISTANCE (0.00001)
 #define P_MINIMUM_FOR_REF (0.0)
-#define RF_THREAD_WINDOW_CHUNK_SIZE (3)
+#define RF_NESTED_WINDOWS_PER_THREAD (3)
+#define RF_NESTED_TREES_PER_TASK (2)
+#define RF_NESTED_WORDS_PER_TASK (1)
+#define RF_ADAPTIVE_BATCH_SIZE (10)
 #define CRF_SAMPLES_PER_BLOCK (32)
 #define SIM_PARENT_PROPORTION (0.10)
 #define SIM_GROWTH_RATE (1.20)
@@ -191,6 +218,7 @@ double crf(input_t *input, double w);
 void msp_output(input_t *input);
 void fb_output(input_t *input);
 void fb_stay_in_state_output(input_t *input);
+void rf_trees_output(input_t *input);
 void output_Q(input_t *input);
   
 #endif
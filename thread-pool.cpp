@@ -0,0 +1,141 @@
+/* RFMIX v2.XX - Local Ancestry and Admixture Analysis
+   Bustamante Lab - Stanford School of Medicine
+   (c) 2016 Mark Hamilton Wright
+
+   This program is licensed for academic research use only
+   unless otherwise stated. Contact cdbadmin@stanford.edu for
+   commercial licensing options.
+
+   Academic and research users should cite Brian Maples'
+   paper describing RFMIX in any publication using RFMIX
+   results. Citation is printed when the program is started. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "kmacros.h"
+#include "mm.h"
+#include "thread-pool.h"
+
+static struct {
+  int n_workers;
+  pthread_t *threads;
+  mm **arenas;
+
+  /* The job being run. generation is incremented for each job so that the workers
+     waiting on start can tell a new job from a spurious wakeup */
+  pool_job_t job;
+  void *arg;
+  int generation;
+  int n_running;
+  int shutdown;
+
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t done;
+} pool;
+
+/* Pins a worker to a single CPU. Where the system has no CPU affinity calls, the
+   workers are left where the scheduler puts them */
+static void pin_to_cpu(pthread_t thread, int worker_idx) {
+#ifdef CPU_SET
+  long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  cpu_set_t set;
+  
+  CPU_ZERO(&set);
+  CPU_SET(worker_idx % n_cpus, &set);
+  if (pthread_setaffinity_np(thread, sizeof(cpu_set_t), &set) != 0)
+    fprintf(stderr,"Warning: could not pin thread %d to a cpu\n", worker_idx);
+#endif
+}
+
+static void *pool_thread(void *targ) {
+  int worker_idx = (int) (intptr_t) targ;
+  int generation = 0;
+  
+  pthread_mutex_lock(&pool.lock);
+  for(;;) {
+    while(pool.generation == generation && !pool.shutdown)
+      pthread_cond_wait(&pool.start, &pool.lock);
+    if (pool.shutdown) break;
+    
+    generation = pool.generation;
+    pool_job_t job = pool.job;
+    void *arg = pool.arg;
+    pthread_mutex_unlock(&pool.lock);
+    
+    job(arg, worker_idx, pool.arenas[worker_idx]);
+
+    pthread_mutex_lock(&pool.lock);
+    if (--pool.n_running == 0) pthread_cond_signal(&pool.done);
+  }
+  pthread_mutex_unlock(&pool.lock);
+
+  return NULL;
+}
+
+void init_thread_pool(int n_workers, int pin_cpus) {
+  pool.n_workers = n_workers;
+  pool.generation = 0;
+  pool.n_running = 0;
+  pool.shutdown = 0;
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.start, NULL);
+  pthread_cond_init(&pool.done, NULL);
+
+  MA(pool.arenas, sizeof(mm *)*n_workers, mm *);
+  for(int i=0; i < n_workers; i++)
+    pool.arenas[i] = new mm(16, WHEREFROM);
+
+  MA(pool.threads, sizeof(pthread_t)*n_workers, pthread_t);
+  pool.threads[0] = pthread_self();
+  for(int i=1; i < n_workers; i++)
+    pthread_create(pool.threads + i, NULL, pool_thread, (void *) (intptr_t) i);
+  
+  if (pin_cpus) {
+    for(int i=0; i < n_workers; i++)
+      pin_to_cpu(pool.threads[i], i);
+  }
+}
+
+/* Runs job on all workers and returns when all of them have finished it */
+void run_thread_pool(pool_job_t job, void *arg) {
+  pthread_mutex_lock(&pool.lock);
+  pool.job = job;
+  pool.arg = arg;
+  pool.n_running = pool.n_workers - 1;
+  pool.generation++;
+  pthread_cond_broadcast(&pool.start);
+  pthread_mutex_unlock(&pool.lock);
+
+  job(arg, 0, pool.arenas[0]);
+
+  pthread_mutex_lock(&pool.lock);
+  while(pool.n_running > 0)
+    pthread_cond_wait(&pool.done, &pool.lock);
+  pthread_mutex_unlock(&pool.lock);
+}
+
+void free_thread_pool(void) {
+  pthread_mutex_lock(&pool.lock);
+  pool.shutdown = 1;
+  pthread_cond_broadcast(&pool.start);
+  pthread_mutex_unlock(&pool.lock);
+  
+  for(int i=1; i < pool.n_workers; i++)
+    pthread_join(pool.threads[i], NULL);
+  for(int i=0; i < pool.n_workers; i++)
+    delete pool.arenas[i];
+  
+  free(pool.threads);
+  free(pool.arenas);
+  pthread_cond_destroy(&pool.done);
+  pthread_cond_destroy(&pool.start);
+  pthread_mutex_destroy(&pool.lock);
+}
@@ -0,0 +1,29 @@
+/* RFMIX v2.XX - Local Ancestry and Admixture Analysis
+   Bustamante Lab - Stanford School of Medicine
+   (c) 2016 Mark Hamilton Wright
+
+   This program is licensed for academic research use only
+   unless otherwise stated. Contact cdbadmin@stanford.edu for
+   commercial licensing options.
+
+   Academic and research users should cite Brian Maples'
+   paper describing RFMIX in any publication using RFMIX
+   results. Citation is printed when the program is started. */
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include "mm.h"
+
+/* The process wide pool of worker threads that random forest and the CRF run their 
+   work on. A job is run by every worker at the same time, each with its index from 
+   0 to n_workers - 1 and its own memory arena. The arenas last as long as the pool,
+   so a job should recycle() its arena before using it, but what the arena has grown
+   to for earlier jobs is kept. Worker 0 is the thread calling run_thread_pool() */
+typedef void (*pool_job_t)(void *arg, int worker_idx, mm *ma);
+
+void init_thread_pool(int n_workers, int pin_cpus);
+void run_thread_pool(pool_job_t job, void *arg);
+void free_thread_pool(void);
+
+#endif